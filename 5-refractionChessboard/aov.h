@@ -0,0 +1,215 @@
+#ifndef __AOV_H__
+#define __AOV_H__
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+// Arbitrary output variables: per-pixel data produced in the same pass as the shaded colour.
+//
+// The first scene_intersect of every sample fills in a FirstHit; render() folds the samples of a pixel
+// into PixelHits, counts the rays traced for the pixel and hands finished tiles to an AovWriter.
+// None of it runs unless render() is given a writer (or denoiser guides, which share FirstHit).
+//
+// File layout: a text line "AOV1 <width> <height> <layers>", one line "<name> <components>" per layer,
+// then for each scanline from the top, each layer's row of native-endian float32 values in turn
+// (components interleaved). IDs are stored as floats, -1 where the ray missed; depth is 1000, the far
+// limit of scene_intersect, there.
+
+const uint32_t NO_ID = std::numeric_limits<uint32_t>::max();
+
+// what the primary ray of one sample saw
+struct FirstHit
+{
+    vec3 normal;
+    vec3 albedo;
+    float depth = 0;
+    uint32_t material = NO_ID;
+    uint32_t object = NO_ID;
+};
+
+// the first hits of a pixel's samples: depth, normal and albedo are averaged, the IDs are those of the
+// first sample since IDs cannot be blended
+struct PixelHits
+{
+    FirstHit sum;
+    int samples = 0;
+
+    void add(const FirstHit &hit)
+    {
+        if (!samples)
+        {
+            sum.material = hit.material;
+            sum.object = hit.object;
+        }
+        sum.normal = sum.normal + hit.normal;
+        sum.albedo = sum.albedo + hit.albedo;
+        sum.depth += hit.depth;
+        samples++;
+    }
+
+    FirstHit mean() const
+    {
+        FirstHit m = sum;
+        if (samples)
+        {
+            m.normal = sum.normal * (1.f / samples);
+            m.albedo = sum.albedo * (1.f / samples);
+            m.depth = sum.depth / samples;
+        }
+        return m;
+    }
+};
+
+enum AovLayer
+{
+    AOV_COLOR,
+    AOV_DEPTH,
+    AOV_NORMAL,
+    AOV_ALBEDO,
+    AOV_MATERIAL,
+    AOV_OBJECT,
+    AOV_RAYS,
+    AOV_LAYERS
+};
+
+const char *const AOV_NAMES[AOV_LAYERS] = {"color", "depth", "normal", "albedo", "material", "object", "rays"};
+const int AOV_COMPONENTS[AOV_LAYERS] = {3, 1, 3, 3, 1, 1, 1};
+
+// layer mask from a comma-separated list of names, "all" for every layer; false on an unknown name
+bool parse_aov_mask(const std::string &list, uint32_t &mask)
+{
+    mask = 0;
+    std::stringstream ss(list);
+    std::string name;
+    while (std::getline(ss, name, ','))
+    {
+        int layer = 0;
+        while (layer < AOV_LAYERS && name != AOV_NAMES[layer])
+            layer++;
+        if (name == "all")
+            mask = (1u << AOV_LAYERS) - 1;
+        else if (layer < AOV_LAYERS)
+            mask |= 1u << layer;
+        else
+            return false;
+    }
+    return mask != 0;
+}
+
+// all layers of one pixel
+struct AovPixel
+{
+    vec3 color;
+    FirstHit hit;
+    uint32_t rays = 0;
+};
+
+// Streams the selected layers to a file as rows of tiles complete. Tiles may arrive in any order from any
+// thread; a band of tile rows is kept until its last tile is in, then written as soon as every band above it
+// has been, so memory follows the bands in flight rather than the image.
+class AovWriter
+{
+public:
+    bool open(const std::string &filename, const int w, const int h, const int tile_size, const uint32_t layer_mask)
+    {
+        width = w;
+        height = h;
+        tile = tile_size;
+        mask = layer_mask;
+        tiles_x = (width + tile - 1) / tile;
+        row_floats = 0;
+        int layers = 0;
+        for (int l = 0; l < AOV_LAYERS; l++)
+            if (mask & 1u << l)
+            {
+                layer_offset[l] = row_floats;
+                row_floats += AOV_COMPONENTS[l] * width;
+                layers++;
+            }
+        ofs.open(filename, std::ios::binary);
+        ofs << "AOV1 " << width << " " << height << " " << layers << "\n";
+        for (int l = 0; l < AOV_LAYERS; l++)
+            if (mask & 1u << l)
+                ofs << AOV_NAMES[l] << " " << AOV_COMPONENTS[l] << "\n";
+        return bool(ofs);
+    }
+
+    bool enabled(const AovLayer layer) const { return mask & 1u << layer; }
+
+    // pixels is the tile's w x h pixels, row by row
+    void write_tile(const int x0, const int y0, const int w, const int h, const std::vector<AovPixel> &pixels)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const int b = y0 / tile;
+        Band &band = bands[b];
+        if (band.data.empty())
+            band.data.assign(size_t(std::min(tile, height - b * tile)) * row_floats, 0);
+        for (int j = 0; j < h; j++)
+        {
+            float *row = &band.data[size_t(y0 - b * tile + j) * row_floats];
+            for (int i = 0; i < w; i++)
+            {
+                const AovPixel &p = pixels[i + j * w];
+                const int x = x0 + i;
+                store(row, AOV_COLOR, x, p.color);
+                store(row, AOV_DEPTH, x, p.hit.depth);
+                store(row, AOV_NORMAL, x, p.hit.normal);
+                store(row, AOV_ALBEDO, x, p.hit.albedo);
+                store(row, AOV_MATERIAL, x, p.hit.material == NO_ID ? -1.f : float(p.hit.material));
+                store(row, AOV_OBJECT, x, p.hit.object == NO_ID ? -1.f : float(p.hit.object));
+                store(row, AOV_RAYS, x, float(p.rays));
+            }
+        }
+        band.tiles++;
+        buffered = std::max(buffered, bands.size());
+        while (!bands.empty() && bands.begin()->first == next_band && bands.begin()->second.tiles == tiles_x)
+        {
+            const std::vector<float> &data = bands.begin()->second.data;
+            ofs.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(float));
+            bands.erase(bands.begin());
+            next_band++;
+        }
+    }
+
+    // most bands held at once, for judging the memory the streaming saves
+    size_t peak_bands() const { return buffered; }
+    size_t band_bytes() const { return size_t(tile) * row_floats * sizeof(float); }
+
+private:
+    struct Band
+    {
+        std::vector<float> data;
+        int tiles = 0;
+    };
+
+    void store(float *row, const AovLayer layer, const int x, const float value) const
+    {
+        if (mask & 1u << layer)
+            row[layer_offset[layer] + x] = value;
+    }
+    void store(float *row, const AovLayer layer, const int x, const vec3 &value) const
+    {
+        if (mask & 1u << layer)
+            for (size_t c = 0; c < 3; c++)
+                row[layer_offset[layer] + x * 3 + c] = value[c];
+    }
+
+    int width = 0, height = 0, tile = 1, tiles_x = 0;
+    uint32_t mask = 0;
+    size_t row_floats = 0;
+    size_t layer_offset[AOV_LAYERS] = {};
+    std::map<int, Band> bands;
+    int next_band = 0;
+    size_t buffered = 0;
+    std::ofstream ofs;
+    std::mutex mutex;
+};
+
+#endif //__AOV_H__
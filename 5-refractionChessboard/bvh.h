@@ -0,0 +1,379 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "geometry.h"
+
+struct Aabb
+{
+    vec3 lo{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+    vec3 hi{-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+
+    Aabb() {}
+    Aabb(const vec3 &bmin, const vec3 &bmax) : lo(bmin), hi(bmax) {}
+
+    // on copies: with std::min/max applied to the members themselves GCC compiles each bound to a compare
+    // and branch rather than to minss/maxss, and these run in the builder's and refit's inner loops
+    void grow(const vec3 &p)
+    {
+        const vec3 l = lo, h = hi;
+        lo = vec3{std::min(l.x, p.x), std::min(l.y, p.y), std::min(l.z, p.z)};
+        hi = vec3{std::max(h.x, p.x), std::max(h.y, p.y), std::max(h.z, p.z)};
+    }
+    void grow(const Aabb &b) // the union, so that growing by an empty box changes nothing
+    {
+        const vec3 l = lo, h = hi, bl = b.lo, bh = b.hi;
+        lo = vec3{std::min(l.x, bl.x), std::min(l.y, bl.y), std::min(l.z, bl.z)};
+        hi = vec3{std::max(h.x, bh.x), std::max(h.y, bh.y), std::max(h.z, bh.z)};
+    }
+    vec3 center() const { return (lo + hi) * 0.5f; }
+
+    // slab test against [0, tmax]; inv_dir is 1/dir per component
+    bool ray_intersect(const vec3 &orig, const vec3 &inv_dir, const float tmax) const
+    {
+        float t0 = 0, t1 = tmax;
+        slab(lo.x, hi.x, orig.x, inv_dir.x, t0, t1);
+        slab(lo.y, hi.y, orig.y, inv_dir.y, t0, t1);
+        slab(lo.z, hi.z, orig.z, inv_dir.z, t0, t1);
+        return t0 <= t1;
+    }
+
+    static void slab(const float lo, const float hi, const float orig, const float inv_dir, float &t0, float &t1)
+    {
+        float tn = (lo - orig) * inv_dir;
+        float tf = (hi - orig) * inv_dir;
+        if (tn > tf)
+            std::swap(tn, tf);
+        t0 = tn > t0 ? tn : t0; // written so that a NaN slab (ray in the slab plane) does not cull
+        t1 = tf < t1 ? tf : t1;
+    }
+};
+
+// inner nodes store their two children next to each other, the left one at offset;
+// leaves store count primitives starting at prims[offset]
+struct BvhNode
+{
+    Aabb box;
+    uint32_t offset;
+    uint32_t count;
+};
+
+const int BVH_BINS = 16;
+const size_t BVH_LEAF_MAX = 8;       // leaves larger than this are split even where SAH would keep them
+const size_t BVH_TASK_MIN = 4096;    // subtrees and binning passes below this many primitives stay in one task
+const float BVH_TRAVERSAL_COST = 1;  // of an inner node, relative to one primitive test
+const float BVH_REBUILD_RATIO = 1.3; // refitted trees are rebuilt once their SAH cost grows past this factor
+
+// Binned SAH builder. Every node bins its primitive centres into BVH_BINS slabs per axis and takes the
+// split with the lowest surface area cost, or stays a leaf when testing its primitives is cheaper. Large
+// subtrees, and the binning passes of large nodes, run as OpenMP tasks; nodes are allocated in sibling pairs
+// from an atomic counter, so tasks only ever write their own nodes and their own range of prims.
+// refit() moves the boxes with the primitives and keeps the topology, sah_cost() tells how far that has
+// degraded the tree since it was built.
+struct Bvh
+{
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> prims;
+    float built_cost = 0; // sah_cost() as built
+
+    void build(const std::vector<Aabb> &bounds)
+    {
+        prims.resize(bounds.size());
+        nodes.assign(2 * prims.size(), BvhNode()); // a binary tree over n leaves or fewer has at most 2n - 1 nodes
+        built_cost = 0;
+        if (prims.empty())
+            return;
+        std::vector<BuildPrim> items(bounds.size());
+        std::atomic<uint32_t> next{1};
+        Aabb box, center_box;
+#pragma omp parallel if (prims.size() >= BVH_TASK_MIN)
+        {
+            Aabb local_box, local_centers;
+#pragma omp for schedule(static)
+            for (size_t i = 0; i < prims.size(); i++)
+            {
+                const Aabb &b = bounds[i];
+                const vec3 c = b.center();
+                items[i] = BuildPrim{{b.lo.x, b.lo.y, b.lo.z, b.hi.x, b.hi.y, b.hi.z}, {c.x, c.y, c.z}, uint32_t(i)};
+                local_box.grow(b);
+                local_centers.grow(c);
+            }
+#pragma omp critical
+            {
+                box.grow(local_box);
+                center_box.grow(local_centers);
+            }
+#pragma omp barrier
+#pragma omp single
+            {
+                nodes[0].box = box;
+                build_node(items.data(), 0, center_box, 0, prims.size(), &next);
+            }
+#pragma omp for schedule(static)
+            for (size_t i = 0; i < prims.size(); i++)
+                prims[i] = items[i].index;
+        }
+        nodes.resize(next);
+        built_cost = sah_cost();
+    }
+
+    // new boxes for primitives that moved; the tree keeps its shape, children always come after their parent
+    void refit(const std::vector<Aabb> &bounds)
+    {
+        for (size_t n = nodes.size(); n--;)
+        {
+            BvhNode &node = nodes[n];
+            node.box = Aabb();
+            if (node.count)
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    node.box.grow(bounds[prims[i]]);
+            else
+            {
+                node.box.grow(nodes[node.offset].box);
+                node.box.grow(nodes[node.offset + 1].box);
+            }
+        }
+    }
+
+    // expected cost of a ray through the root box: BVH_TRAVERSAL_COST per inner node and one per primitive
+    // tested, each weighted by the chance of hitting the node's box (its area over the root's)
+    float sah_cost() const
+    {
+        if (nodes.empty())
+            return 0;
+        float cost = 0;
+        for (const BvhNode &node : nodes)
+            cost += area(node.box) * (node.count ? node.count : BVH_TRAVERSAL_COST);
+        return cost / std::max(area(nodes[0].box), std::numeric_limits<float>::min());
+    }
+
+    bool needs_rebuild(const float max_ratio = BVH_REBUILD_RATIO) const { return sah_cost() > max_ratio * built_cost; }
+
+    static float area(const Aabb &box)
+    {
+        vec3 d = box.hi - box.lo;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    // calls intersect(prim) for every primitive whose leaf the ray reaches within tmax;
+    // intersect may shrink tmax and returns true to stop the traversal (any-hit queries)
+    template <typename Intersect>
+    void traverse(const vec3 &orig, const vec3 &dir, float &tmax, Intersect intersect) const
+    {
+        if (nodes.empty())
+            return;
+        const vec3 inv_dir{1.f / dir.x, 1.f / dir.y, 1.f / dir.z};
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const BvhNode &node = nodes[stack[--top]];
+            if (!node.box.ray_intersect(orig, inv_dir, tmax))
+                continue;
+            if (node.count)
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    if (intersect(prims[i]))
+                        return;
+                continue;
+            }
+            stack[top++] = node.offset + 1;
+            stack[top++] = node.offset;
+        }
+    }
+
+private:
+    // what the builder needs of a primitive, as plain floats. The records are partitioned along with the
+    // tree, so every node bins a contiguous run of them instead of gathering boxes through prims at every
+    // level; prims is filled from the final order.
+    struct BuildPrim
+    {
+        float box[6];    // lo x, y, z, hi x, y, z
+        float center[3];
+        uint32_t index;
+    };
+
+    // left uninitialized; a node clears the bins it uses, so small nodes do not pay for all of them
+    struct Bin
+    {
+        float box[6]; // as in BuildPrim
+        uint32_t count;
+
+        void clear()
+        {
+            std::fill(box, box + 3, std::numeric_limits<float>::max());
+            std::fill(box + 3, box + 6, -std::numeric_limits<float>::max());
+            count = 0;
+        }
+        void grow(const float *b)
+        {
+            for (int a = 0; a < 3; a++)
+            {
+                const float lo = box[a], hi = box[3 + a], blo = b[a], bhi = b[3 + a]; // as in Aabb::grow
+                box[a] = std::min(lo, blo);
+                box[3 + a] = std::max(hi, bhi);
+            }
+        }
+        void merge(const Bin &b)
+        {
+            grow(b.box);
+            count += b.count;
+        }
+        Aabb aabb() const { return Aabb(vec3{box[0], box[1], box[2]}, vec3{box[3], box[4], box[5]}); }
+    };
+    typedef Bin Bins[3][BVH_BINS];
+
+    static void clear(Bins &bins, const int count)
+    {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < count; b++)
+                bins[a][b].clear();
+    }
+
+    struct Split
+    {
+        int axis = -1, bin = 0; // left side: bins 0..bin of axis
+        Aabb left_box, right_box;
+    };
+
+    // bins per axis of a node: fewer for small nodes, where the sweep over empty bins would dominate
+    static int bin_count(const size_t count) { return int(std::min<size_t>(BVH_BINS, count + 2)); }
+
+    static int bin_of(const float c, const float lo, const float scale, const int bins)
+    {
+        return std::min(bins - 1, std::max(0, int((c - lo) * scale)));
+    }
+
+    static void bin_range(const BuildPrim *items, const size_t begin, const size_t end, const Aabb &centers, const int bins, Bins &out)
+    {
+        float lo[3], scale[3];
+        for (size_t a = 0; a < 3; a++)
+        {
+            lo[a] = centers.lo[a];
+            scale[a] = centers.hi[a] > centers.lo[a] ? bins / (centers.hi[a] - centers.lo[a]) : 0;
+        }
+        clear(out, bins);
+        for (size_t i = begin; i < end; i++)
+        {
+            const BuildPrim &item = items[i];
+            for (int a = 0; a < 3; a++)
+            {
+                Bin &bin = out[a][bin_of(item.center[a], lo[a], scale[a], bins)];
+                bin.grow(item.box);
+                bin.count++;
+            }
+        }
+    }
+
+    // the cheapest split over all axes; false where a leaf is cheaper (and small enough) or nothing separates
+    static bool find_split(const BuildPrim *items, const size_t begin, const size_t end, const Aabb &box, const Aabb &centers, Split &split)
+    {
+        const size_t count = end - begin;
+        const int bins = bin_count(count);
+        Bins binned;
+        if (count < 2 * BVH_TASK_MIN)
+            bin_range(items, begin, end, centers, bins, binned);
+        else
+        { // large nodes near the root: bin in chunks in parallel, then merge
+            const size_t chunks = std::min<size_t>(64, count / BVH_TASK_MIN);
+            std::vector<Bins> partial(chunks);
+            for (size_t k = 0; k < chunks; k++)
+            {
+#pragma omp task firstprivate(k) shared(partial)
+                bin_range(items, begin + count * k / chunks, begin + count * (k + 1) / chunks, centers, bins, partial[k]);
+            }
+#pragma omp taskwait
+            clear(binned, bins);
+            for (size_t k = 0; k < chunks; k++)
+                for (size_t a = 0; a < 3; a++)
+                    for (int b = 0; b < bins; b++)
+                        binned[a][b].merge(partial[k][a][b]);
+        }
+
+        float best = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; a++)
+        {
+            if (centers.hi[a] <= centers.lo[a])
+                continue;
+            float right_cost[BVH_BINS]; // area * count of bins b + 1 and up
+            Aabb right;
+            uint32_t right_count = 0;
+            for (int b = bins - 1; b > 0; b--)
+            {
+                right.grow(binned[a][b].aabb());
+                right_count += binned[a][b].count;
+                right_cost[b - 1] = right_count ? area(right) * right_count : 0;
+            }
+            Aabb left;
+            uint32_t left_count = 0;
+            for (int b = 0; b < bins - 1; b++)
+            {
+                left.grow(binned[a][b].aabb());
+                left_count += binned[a][b].count;
+                if (!left_count || left_count == count)
+                    continue;
+                float cost = area(left) * left_count + right_cost[b];
+                if (cost < best)
+                {
+                    best = cost;
+                    split.axis = a;
+                    split.bin = b;
+                }
+            }
+        }
+        if (split.axis < 0)
+            return false;
+        if (count <= BVH_LEAF_MAX && BVH_TRAVERSAL_COST + best / std::max(area(box), std::numeric_limits<float>::min()) >= count)
+            return false;
+        for (int b = 0; b < bins; b++)
+            (b <= split.bin ? split.left_box : split.right_box).grow(binned[split.axis][b].aabb());
+        return true;
+    }
+
+    // nodes[index].box is set by the caller; centers bounds the centres of items[begin, end)
+    void build_node(BuildPrim *items, const uint32_t index, const Aabb &centers, const size_t begin, const size_t end, std::atomic<uint32_t> *next)
+    {
+        Split split;
+        if (end - begin <= 1 || !find_split(items, begin, end, nodes[index].box, centers, split))
+        {
+            nodes[index].offset = begin;
+            nodes[index].count = end - begin;
+            return;
+        }
+        // partition on the same bin computation as find_split, bounding the centres of either side on the way
+        const int axis = split.axis, bins = bin_count(end - begin);
+        const float lo = centers.lo[axis], scale = bins / (centers.hi[axis] - centers.lo[axis]);
+        Aabb left_centers, right_centers;
+        size_t mid = begin;
+        for (size_t i = begin; i < end; i++)
+        {
+            const float *c = items[i].center;
+            if (bin_of(c[axis], lo, scale, bins) <= split.bin)
+            {
+                left_centers.grow(vec3{c[0], c[1], c[2]});
+                std::swap(items[i], items[mid++]);
+            }
+            else
+                right_centers.grow(vec3{c[0], c[1], c[2]});
+        }
+        const uint32_t children = next->fetch_add(2);
+        nodes[index].offset = children;
+        nodes[index].count = 0;
+        nodes[children].box = split.left_box;
+        nodes[children + 1].box = split.right_box;
+        if (end - begin > BVH_TASK_MIN)
+        {
+#pragma omp task firstprivate(left_centers)
+            build_node(items, children, left_centers, begin, mid, next);
+        }
+        else
+            build_node(items, children, left_centers, begin, mid, next);
+        build_node(items, children + 1, right_centers, mid, end, next);
+    }
+};
+
+#endif //__BVH_H__
@@ -0,0 +1,178 @@
+#ifndef __DENOISE_H__
+#define __DENOISE_H__
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "aov.h"
+#include "geometry.h"
+#include "profile.h"
+
+// Edge-avoiding a-trous wavelet denoiser for the float framebuffer.
+//
+// Every pass is a 5x5 B3-spline filter with its taps spread 2^pass pixels apart, so five passes cover a
+// 61 pixel wide footprint at 25 taps per pixel each. A tap is weighted down by how far its colour and the
+// normal, albedo and depth of its first hit are from those of the centre pixel, which keeps geometric and
+// texture edges sharp. All buffers are planes of floats and the tap loops run along contiguous rows so that
+// they vectorize; rows are split across the OpenMP threads.
+
+// per-pixel guides, averaged over the samples of the pixel
+struct GuideBuffers
+{
+    int width = 0, height = 0;
+    int spp = 1;
+    std::vector<float> nx, ny, nz, ar, ag, ab, depth;
+
+    void resize(const int w, const int h)
+    {
+        width = w;
+        height = h;
+        for (std::vector<float> *plane : {&nx, &ny, &nz, &ar, &ag, &ab, &depth})
+            plane->assign(size_t(w) * h, 0);
+    }
+
+    void set(const size_t p, const FirstHit &s)
+    {
+        nx[p] = s.normal.x;
+        ny[p] = s.normal.y;
+        nz[p] = s.normal.z;
+        ar[p] = s.albedo.x;
+        ag[p] = s.albedo.y;
+        ab[p] = s.albedo.z;
+        depth[p] = s.depth;
+    }
+};
+
+struct DenoiseSettings
+{
+    int passes = 5;
+    float sigma_color = 0.5;  // at one sample per pixel; follows the noise down by 1/sqrt(spp) and halves every pass
+    float sigma_normal = 0.2;
+    float sigma_albedo = 0.1;
+    float sigma_depth = 0.05;  // relative to the depth of the centre pixel
+};
+
+// e^x for x <= 0 without a library call, so that the tap loops vectorize; relative error below 2e-5.
+// The clamp to -80 is done on the bits: for negative floats a larger magnitude is a larger unsigned
+// pattern, and an integer min does not stop the vectorizer the way a float compare does.
+inline float fast_exp(float x)
+{
+    uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    u = std::min(u, 0xC2A00000u); // -80.f
+    std::memcpy(&x, &u, sizeof(x));
+    x *= 1.44269504f;                     // 2^x from here
+    int i = int(x);                       // truncates towards zero, leaving the fraction in (-1, 0]
+    float t = (x - i) * 0.69314718f;
+    float p = 1 + t * (1 + t * (1 / 2.f + t * (1 / 6.f + t * (1 / 24.f + t * (1 / 120.f + t * (1 / 720.f))))));
+    int32_t bits = (i + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+void denoise(const std::vector<vec3> &in, std::vector<vec3> &out, const GuideBuffers &guides, const DenoiseSettings &settings = DenoiseSettings())
+{
+    PROFILE_SCOPE("denoise");
+    const int width = guides.width, height = guides.height;
+    const size_t n = size_t(width) * height;
+    std::vector<float> color[3], next[3], inv_depth(n);
+    for (size_t c = 0; c < 3; c++)
+    {
+        color[c].resize(n);
+        next[c].resize(n);
+        for (size_t p = 0; p < n; p++)
+            color[c][p] = in[p][c];
+    }
+    for (size_t p = 0; p < n; p++)
+        inv_depth[p] = 1.f / std::max(guides.depth[p], 1e-6f);
+    const float kernel[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+    const float inv_normal = 1 / (settings.sigma_normal * settings.sigma_normal);
+    const float inv_albedo = 1 / (settings.sigma_albedo * settings.sigma_albedo);
+    const float inv_depth_sigma = 1 / (settings.sigma_depth * settings.sigma_depth);
+
+    for (int pass = 0; pass < settings.passes; pass++)
+    {
+        const int step = 1 << pass;
+        const float sigma_color = settings.sigma_color / (step * std::sqrt(float(std::max(1, guides.spp))));
+        const float inv_color = 1 / (sigma_color * sigma_color);
+#pragma omp parallel
+        {
+            std::vector<float> sum_r(width), sum_g(width), sum_b(width), sum_w(width);
+#pragma omp for schedule(static)
+            for (int y = 0; y < height; y++)
+            {
+                std::fill(sum_r.begin(), sum_r.end(), 0.f);
+                std::fill(sum_g.begin(), sum_g.end(), 0.f);
+                std::fill(sum_b.begin(), sum_b.end(), 0.f);
+                std::fill(sum_w.begin(), sum_w.end(), 0.f);
+                const size_t row = size_t(y) * width;
+                const float *cr = &color[0][row], *cg = &color[1][row], *cb = &color[2][row];
+                const float *nx = &guides.nx[row], *ny = &guides.ny[row], *nz = &guides.nz[row];
+                const float *ar = &guides.ar[row], *ag = &guides.ag[row], *ab = &guides.ab[row];
+                const float *d = &guides.depth[row], *rd = &inv_depth[row];
+                for (int ky = 0; ky < 5; ky++)
+                {
+                    const int yy = y + (ky - 2) * step;
+                    if (yy < 0 || yy >= height)
+                        continue;
+                    for (int kx = 0; kx < 5; kx++)
+                    {
+                        // every pixel x of the row takes its tap from x + dx of row yy
+                        const int dx = (kx - 2) * step;
+                        const int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+                        const size_t q = size_t(yy) * width;
+                        const float *qr = &color[0][q], *qg = &color[1][q], *qb = &color[2][q];
+                        const float *qnx = &guides.nx[q], *qny = &guides.ny[q], *qnz = &guides.nz[q];
+                        const float *qar = &guides.ar[q], *qag = &guides.ag[q], *qab = &guides.ab[q];
+                        const float *qd = &guides.depth[q];
+                        const float k = kernel[ky] * kernel[kx];
+#pragma omp simd
+                        for (int x = x0; x < x1; x++)
+                        {
+                            const int t = x + dx;
+                            float c2 = (cr[x] - qr[t]) * (cr[x] - qr[t]) + (cg[x] - qg[t]) * (cg[x] - qg[t]) + (cb[x] - qb[t]) * (cb[x] - qb[t]);
+                            float n2 = (nx[x] - qnx[t]) * (nx[x] - qnx[t]) + (ny[x] - qny[t]) * (ny[x] - qny[t]) + (nz[x] - qnz[t]) * (nz[x] - qnz[t]);
+                            float a2 = (ar[x] - qar[t]) * (ar[x] - qar[t]) + (ag[x] - qag[t]) * (ag[x] - qag[t]) + (ab[x] - qab[t]) * (ab[x] - qab[t]);
+                            float dd = (d[x] - qd[t]) * rd[x];
+                            float w = k * fast_exp(-(c2 * inv_color + n2 * inv_normal + a2 * inv_albedo + dd * dd * inv_depth_sigma));
+                            sum_r[x] += w * qr[t];
+                            sum_g[x] += w * qg[t];
+                            sum_b[x] += w * qb[t];
+                            sum_w[x] += w;
+                        }
+                    }
+                }
+                for (int x = 0; x < width; x++)
+                { // the centre tap always counts, so sum_w > 0
+                    next[0][row + x] = sum_r[x] / sum_w[x];
+                    next[1][row + x] = sum_g[x] / sum_w[x];
+                    next[2][row + x] = sum_b[x] / sum_w[x];
+                }
+            }
+        }
+        for (size_t c = 0; c < 3; c++)
+            color[c].swap(next[c]);
+    }
+
+    out.resize(n);
+    for (size_t p = 0; p < n; p++)
+        out[p] = vec3{color[0][p], color[1][p], color[2][p]};
+}
+
+// peak signal to noise ratio in dB over colours clamped to [0, 1]
+double psnr(const std::vector<vec3> &image, const std::vector<vec3> &reference)
+{
+    double err = 0;
+    for (size_t p = 0; p < image.size(); p++)
+        for (size_t c = 0; c < 3; c++)
+        {
+            double e = std::max(0.f, std::min(1.f, image[p][c])) - std::max(0.f, std::min(1.f, reference[p][c]));
+            err += e * e;
+        }
+    err /= image.size() * 3;
+    return err > 0 ? 10 * std::log10(1 / err) : 99;
+}
+
+#endif //__DENOISE_H__
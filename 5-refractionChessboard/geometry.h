@@ -51,6 +51,32 @@ vec3 cross(vec3 v1, vec3 v2) {
     return { v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x };
 }
 
+// affine map p -> x*p.x + y*p.y + z*p.z + t, e.g. object-to-world of an instance
+struct Affine {
+    vec3 x{1,0,0}, y{0,1,0}, z{0,0,1}, t;
+    vec3 point(const vec3 &p)  const { return x*p.x + y*p.y + z*p.z + t; }
+    vec3 vector(const vec3 &v) const { return x*v.x + y*v.y + z*v.z; }
+    vec3 normal(const vec3 &n) const { return { x*n, y*n, z*n }; } // normals go through the transpose of the inverse
+    Affine inverse() const {
+        vec3 r0 = cross(y, z), r1 = cross(z, x), r2 = cross(x, y);
+        float inv_det = 1.f/(x*r0);
+        Affine inv;
+        inv.x = vec3{r0.x, r1.x, r2.x}*inv_det;
+        inv.y = vec3{r0.y, r1.y, r2.y}*inv_det;
+        inv.z = vec3{r0.z, r1.z, r2.z}*inv_det;
+        inv.t = -inv.vector(t);
+        return inv;
+    }
+    static Affine place(const vec3 &position, float yaw, float scale) { // rotation about y, uniform scale, translation
+        Affine a;
+        a.x = vec3{ std::cos(yaw), 0, -std::sin(yaw)}*scale;
+        a.y = vec3{0, scale, 0};
+        a.z = vec3{ std::sin(yaw), 0,  std::cos(yaw)}*scale;
+        a.t = position;
+        return a;
+    }
+};
+
 template <size_t DIM> std::ostream& operator<<(std::ostream& out, const vec<DIM>& v) {
     for (size_t i=0; i<DIM; i++)
         out << v[i] << " " ;
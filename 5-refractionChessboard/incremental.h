@@ -0,0 +1,200 @@
+#ifndef __INCREMENTAL_H__
+#define __INCREMENTAL_H__
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "aov.h"
+#include "bvh.h"
+#include "geometry.h"
+
+// Per-tile dependency cache for incremental re-rendering.
+// While a tile is traced every ray segment (primary, secondary and shadow, up to its closest hit or the
+// occluder that ended it) is appended to the tile's list, a single store per ray; walking each segment
+// through a voxel grid instead cost more than the re-tracing it saved. A pixel can only change after an edit
+// if one of its segments crosses the edited object's old or new bounds, so only the pixels with a segment
+// through either box are traced again; the others of their tile keep their colour and their segments. The
+// test is exact up to those boxes and works wherever the edit is. An edit of an object's material alone
+// only reaches the pixels with a segment ending on that object.
+// A segment takes 32 bytes, and their number grows with spp and the depth of the ray trees (2.8M, 86 MB, for
+// the chessboard at 1 spp). The cache therefore has a budget the tiles take their room from as they grow; a
+// tile that finds it spent stops recording, hands its room back and is traced again in full after any edit.
+struct DepSegment
+{
+    vec3 orig, dir;
+    float tmax;
+    uint32_t object; // hit at tmax, NO_ID for misses and shadow rays
+};
+
+// the segments the tiles of a cache may still take
+struct SegmentPool
+{
+    std::atomic<size_t> available{0};
+
+    bool take(const size_t n)
+    {
+        size_t a = available.load();
+        while (a >= n && !available.compare_exchange_weak(a, a - n))
+            ;
+        return a >= n;
+    }
+    void give(const size_t n) { available += n; }
+};
+
+// the segments of a tile, pixel after pixel in row-major order
+struct TileDeps
+{
+    std::vector<DepSegment> segments;
+    std::vector<uint32_t> pixel_end; // the segments of pixel k end at pixel_end[k]
+    std::vector<char> stale;         // pixels to re-trace, see DependencyCache::invalidate
+    size_t capacity = 0;             // segments taken from the pool
+    bool overflowed = false;         // the pool ran out while recording: every pixel is stale
+    SegmentPool *pool = nullptr;
+
+    // starts recording the tile again; the previous recording stays available to keep() until end()
+    void begin()
+    {
+        segments.swap(previous);
+        pixel_end.swap(previous_end);
+        segments.clear();
+        pixel_end.clear();
+        overflowed = false;
+    }
+    void add(const vec3 &orig, const vec3 &dir, const float tmax, const uint32_t object = NO_ID)
+    {
+        if (!overflowed && (segments.size() < capacity || reserve(segments.size() + 1)))
+            segments.push_back(DepSegment{orig, dir, tmax, object});
+    }
+    void end_pixel() { pixel_end.push_back(segments.size()); }
+    // the next pixel was not traced again: its segments are those of the previous recording
+    void keep()
+    {
+        const size_t k = pixel_end.size();
+        const size_t first = k ? previous_end[k - 1] : 0;
+        if (!overflowed && reserve(segments.size() + previous_end[k] - first))
+            segments.insert(segments.end(), previous.begin() + first, previous.begin() + previous_end[k]);
+        end_pixel();
+    }
+    // the tile is done: the previous recording is released
+    void end() { std::vector<DepSegment>().swap(previous); }
+
+    // flags the pixels with a segment for which affected(segment) holds; false if there is none
+    template <typename Affected>
+    bool invalidate(Affected affected)
+    {
+        if (overflowed)
+        {
+            stale.assign(pixel_end.size(), 1);
+            return true;
+        }
+        stale.assign(pixel_end.size(), 0);
+        bool any = false;
+        for (size_t k = 0, i = 0; k < pixel_end.size(); i = pixel_end[k++])
+            for (; i < pixel_end[k] && !stale[k]; i++)
+            {
+                stale[k] = affected(segments[i]);
+                any |= stale[k];
+            }
+        return any;
+    }
+
+private:
+    // room for n segments, taken from the pool in doubling steps; false, dropping the segments, if it is spent
+    bool reserve(const size_t n)
+    {
+        while (capacity < n)
+        {
+            const size_t step = std::max(capacity, size_t(256));
+            if (!pool->take(step))
+            {
+                overflowed = true;
+                std::vector<DepSegment>().swap(segments);
+                pool->give(capacity);
+                capacity = 0;
+                return false;
+            }
+            capacity += step;
+        }
+        segments.reserve(capacity);
+        return true;
+    }
+
+    std::vector<DepSegment> previous;
+    std::vector<uint32_t> previous_end;
+};
+
+struct DependencyCache
+{
+    std::vector<TileDeps> tiles;
+    size_t max_bytes = size_t(128) << 20; // for the segments of all tiles
+
+    // count empty tiles drawing on a fresh pool of max_bytes, unless the cache already has that many
+    void resize(const size_t count)
+    {
+        if (tiles.size() == count)
+            return;
+        tiles.assign(count, TileDeps());
+        pool.available = max_bytes / sizeof(DepSegment);
+        for (TileDeps &t : tiles)
+            t.pool = &pool;
+    }
+
+    size_t segments() const
+    {
+        size_t n = 0;
+        for (const TileDeps &t : tiles)
+            n += t.segments.size();
+        return n;
+    }
+    // tiles the pool ran out on, which are always traced again
+    size_t overflowed() const
+    {
+        size_t n = 0;
+        for (const TileDeps &t : tiles)
+            n += t.overflowed;
+        return n;
+    }
+
+    // tiles to re-trace after an object moved from [old_min, old_max] to [new_min, new_max], with their
+    // stale pixels flagged; returns the number of those pixels
+    size_t invalidate(const vec3 &old_min, const vec3 &old_max, const vec3 &new_min, const vec3 &new_max, std::vector<char> &dirty)
+    {
+        const Aabb old_box = padded(old_min, old_max), new_box = padded(new_min, new_max);
+        return flag(dirty, [&](const DepSegment &s) {
+            const vec3 inv_dir{1.f / s.dir.x, 1.f / s.dir.y, 1.f / s.dir.z};
+            return old_box.ray_intersect(s.orig, inv_dir, s.tmax) || new_box.ray_intersect(s.orig, inv_dir, s.tmax);
+        });
+    }
+
+    // the same after a change to the material of object that left its geometry alone
+    size_t invalidate_object(const uint32_t object, std::vector<char> &dirty)
+    {
+        return flag(dirty, [object](const DepSegment &s) { return s.object == object; });
+    }
+
+private:
+    SegmentPool pool;
+
+    template <typename Affected>
+    size_t flag(std::vector<char> &dirty, Affected affected)
+    {
+        size_t pixels = 0;
+        dirty.assign(tiles.size(), 0);
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : pixels)
+        for (size_t t = 0; t < tiles.size(); t++)
+        {
+            dirty[t] = tiles[t].invalidate(affected);
+            pixels += std::count(tiles[t].stale.begin(), tiles[t].stale.end(), 1);
+        }
+        return pixels;
+    }
+
+    // grown a little so that hits computed on the surface, rounding included, stay inside
+    static Aabb padded(const vec3 &bmin, const vec3 &bmax)
+    {
+        const vec3 pad = (bmax - bmin) * 1e-3f + vec3{1e-4f, 1e-4f, 1e-4f};
+        return Aabb(bmin - pad, bmax + pad);
+    }
+};
+
+#endif //__INCREMENTAL_H__
@@ -0,0 +1,210 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "geometry.h"
+
+// Thread placement and node-local memory for multi-socket machines.
+//
+// Workers are pinned one per CPU, filling a node's CPUs before moving to the next. Framebuffer tiles are
+// split into one contiguous range per node, each in its own anonymous mapping whose pages are first written
+// by workers of that node; under Linux's default first-touch policy that puts them in the node's memory.
+// Workers take tiles from their own node's range before helping the others, so remote writes are limited to
+// the tail of a frame. The topology comes from /sys; without it (or on one node) this all degrades to
+// pinned threads over a single range.
+
+struct NumaNode
+{
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+struct WorkerPlacement
+{
+    int cpu;
+    int node; // index into the topology, not the kernel's node id
+};
+
+// "0-3,8,10-11" as used by /sys/devices/system
+std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> ids;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        int lo, hi;
+        char dash;
+        std::istringstream in(range);
+        if (!(in >> lo))
+            continue;
+        hi = in >> dash >> hi ? hi : lo;
+        for (int id = lo; id <= hi; id++)
+            ids.push_back(id);
+    }
+    return ids;
+}
+
+// the nodes with CPUs this process may run on; a single node with all of them when /sys has no node information
+std::vector<NumaNode> numa_topology()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+            CPU_SET(cpu, &allowed);
+
+    std::vector<NumaNode> nodes;
+    std::string online;
+    std::getline(std::ifstream("/sys/devices/system/node/online"), online);
+    for (int id : parse_cpu_list(online))
+    {
+        std::string cpulist;
+        std::getline(std::ifstream("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"), cpulist);
+        NumaNode node;
+        node.id = id;
+        for (int cpu : parse_cpu_list(cpulist))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                node.cpus.push_back(cpu);
+        if (!node.cpus.empty()) // memory-only nodes run no workers
+            nodes.push_back(node);
+    }
+    if (nodes.empty())
+    {
+        nodes.resize(1);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                nodes[0].cpus.push_back(cpu);
+    }
+    return nodes;
+}
+
+// one worker per CPU of the first node_limit nodes (all when 0)
+std::vector<WorkerPlacement> place_workers(const std::vector<NumaNode> &nodes, const size_t node_limit = 0)
+{
+    std::vector<WorkerPlacement> workers;
+    for (size_t n = 0; n < nodes.size() && (!node_limit || n < node_limit); n++)
+        for (int cpu : nodes[n].cpus)
+            workers.push_back(WorkerPlacement{cpu, int(n)});
+    return workers;
+}
+
+int worker_nodes(const std::vector<WorkerPlacement> &workers)
+{
+    int nodes = 0;
+    for (const WorkerPlacement &w : workers)
+        nodes = std::max(nodes, w.node + 1);
+    return nodes;
+}
+
+// restricts the calling thread to one CPU; false if the kernel refused (e.g. the CPU is outside the cgroup)
+bool pin_thread(const int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// framebuffer tiles of tile_pixels pixels each, stored as one range of consecutive tiles per node
+class NodeFramebuffer
+{
+public:
+    ~NodeFramebuffer() { release(); }
+
+    // maps the ranges without touching them; every range must then be touch()ed by its own node's workers
+    void allocate(const int node_count, const int tile_count, const size_t tile_pixels)
+    {
+        release();
+        tiles = tile_count;
+        pixels = tile_pixels;
+        first.resize(node_count + 1);
+        for (int n = 0; n <= node_count; n++)
+            first[n] = int(size_t(tiles) * n / node_count);
+        for (int n = 0; n < node_count; n++)
+        {
+            size_t bytes = range_pixels(n) * sizeof(vec3);
+            void *p = bytes ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : nullptr;
+            base.push_back(p == MAP_FAILED ? nullptr : static_cast<vec3 *>(p));
+        }
+    }
+
+    bool allocated() const { return !base.empty() && std::find(base.begin(), base.end(), nullptr) == base.end(); }
+    int node_count() const { return int(base.size()); }
+    int tile_count() const { return tiles; }
+    int first_tile(const int node) const { return first[node]; }
+    int end_tile(const int node) const { return first[node + 1]; }
+
+    // first write of share worker/workers of a node's range, which places those pages
+    void touch(const int node, const int worker, const int workers)
+    {
+        size_t n = range_pixels(node);
+        std::uninitialized_fill(base[node] + n * worker / workers, base[node] + n * (worker + 1) / workers, vec3{0, 0, 0});
+    }
+
+    vec3 *tile(const int t)
+    {
+        int n = int(std::upper_bound(first.begin(), first.end(), t) - first.begin()) - 1;
+        return base[n] + size_t(t - first[n]) * pixels;
+    }
+
+private:
+    size_t range_pixels(const int node) const { return size_t(first[node + 1] - first[node]) * pixels; }
+
+    void release()
+    {
+        for (size_t n = 0; n < base.size(); n++)
+            if (base[n])
+                munmap(base[n], range_pixels(n) * sizeof(vec3));
+        base.clear();
+        first.clear();
+    }
+
+    int tiles = 0;
+    size_t pixels = 0;
+    std::vector<int> first; // first tile of every node, and the tile count at the end
+    std::vector<vec3 *> base;
+};
+
+// hands out the tiles of a NodeFramebuffer, own node first
+class NodeTileQueue
+{
+public:
+    explicit NodeTileQueue(const NodeFramebuffer &fb) : framebuffer(fb), next_tile(new std::atomic<int>[fb.node_count()])
+    {
+        for (int n = 0; n < fb.node_count(); n++)
+            next_tile[n] = fb.first_tile(n);
+    }
+
+    // false once every tile is taken; stolen counts tiles taken from another node's range
+    bool next(const int node, int &tile, size_t &stolen)
+    {
+        const int nodes = framebuffer.node_count();
+        for (int k = 0; k < nodes; k++)
+        {
+            const int n = (node + k) % nodes;
+            tile = next_tile[n]++;
+            if (tile < framebuffer.end_tile(n))
+            {
+                stolen += k > 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    const NodeFramebuffer &framebuffer;
+    std::unique_ptr<std::atomic<int>[]> next_tile;
+};
+
+#endif //__NUMA_H__
@@ -0,0 +1,304 @@
+#ifndef __OUT_OF_CORE_H__
+#define __OUT_OF_CORE_H__
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bvh.h"
+
+// Out-of-core geometry for scenes larger than RAM.
+//
+// Primitives are partitioned spatially into chunks and stored in a file: ChunkFileHeader, a table of
+// ChunkEntry, then the raw primitive records chunk after chunk. The file is memory-mapped; only the small
+// chunk table and a bounded set of resident chunks (records copied out of the mapping plus a chunk BVH)
+// are kept in memory. Rays are traced in batches: each ray is queued on every chunk its path crosses and
+// the chunks are then processed one at a time, so a chunk is paged in once per batch rather than per ray.
+// Primitive is any trivially copyable type with bounds(lo, hi) and ray_intersect(orig, dir, t).
+struct ChunkFileHeader
+{
+    char magic[8];
+    uint64_t chunks;
+    uint64_t primitives;
+    uint64_t record_size;
+};
+
+struct ChunkEntry
+{
+    Aabb bounds;
+    uint64_t offset;
+    uint64_t count;
+};
+
+const char CHUNK_FILE_MAGIC[8] = {'T', 'R', 'T', 'O', 'O', 'C', '0', '1'};
+
+// median splits on primitive centres until chunks hold at most chunk_size primitives
+template <typename Primitive>
+bool write_chunk_file(const std::string &filename, const std::vector<Primitive> &primitives, const size_t chunk_size)
+{
+    std::vector<uint32_t> order(primitives.size());
+    std::vector<Aabb> bounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); i++)
+    {
+        order[i] = i;
+        primitives[i].bounds(bounds[i].lo, bounds[i].hi);
+    }
+    std::vector<std::pair<size_t, size_t>> ranges, pending{{0, primitives.size()}};
+    while (!pending.empty())
+    {
+        std::pair<size_t, size_t> r = pending.back();
+        pending.pop_back();
+        if (r.second - r.first <= chunk_size)
+        {
+            ranges.push_back(r);
+            continue;
+        }
+        Aabb centers;
+        for (size_t i = r.first; i < r.second; i++)
+            centers.grow(bounds[order[i]].center());
+        vec3 extent = centers.hi - centers.lo;
+        size_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t mid = (r.first + r.second) / 2;
+        std::nth_element(order.begin() + r.first, order.begin() + mid, order.begin() + r.second, [&](uint32_t a, uint32_t b) {
+            return bounds[a].center()[axis] < bounds[b].center()[axis];
+        });
+        pending.push_back({mid, r.second});
+        pending.push_back({r.first, mid});
+    }
+
+    std::ofstream ofs(filename, std::ios::binary);
+    ChunkFileHeader header;
+    std::memcpy(header.magic, CHUNK_FILE_MAGIC, sizeof(header.magic));
+    header.chunks = ranges.size();
+    header.primitives = primitives.size();
+    header.record_size = sizeof(Primitive);
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t offset = sizeof(header) + ranges.size() * sizeof(ChunkEntry);
+    for (const std::pair<size_t, size_t> &r : ranges)
+    {
+        ChunkEntry entry;
+        for (size_t i = r.first; i < r.second; i++)
+            entry.bounds.grow(bounds[order[i]]);
+        entry.offset = offset;
+        entry.count = r.second - r.first;
+        offset += entry.count * sizeof(Primitive);
+        ofs.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    }
+    for (size_t i = 0; i < order.size(); i++)
+        ofs.write(reinterpret_cast<const char *>(&primitives[order[i]]), sizeof(Primitive));
+    return bool(ofs);
+}
+
+template <typename Primitive>
+struct ResidentChunk
+{
+    std::vector<Primitive> primitives;
+    Bvh bvh;
+
+    size_t bytes() const { return primitives.size() * sizeof(Primitive) + bvh.nodes.size() * sizeof(BvhNode) + bvh.prims.size() * sizeof(uint32_t); }
+};
+
+template <typename Primitive>
+class ChunkStore
+{
+public:
+    ChunkStore(const size_t capacity_bytes) : capacity(capacity_bytes) {}
+    ChunkStore(const ChunkStore &) = delete;
+    ChunkStore &operator=(const ChunkStore &) = delete;
+    ~ChunkStore()
+    {
+        if (base)
+            munmap(base, size);
+    }
+
+    bool open(const std::string &filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(ChunkFileHeader))
+        {
+            size = st.st_size;
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            base = p == MAP_FAILED ? nullptr : static_cast<unsigned char *>(p);
+        }
+        ::close(fd);
+        if (!base)
+            return false;
+        ChunkFileHeader header;
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, CHUNK_FILE_MAGIC, sizeof(header.magic)) || header.record_size != sizeof(Primitive) ||
+            sizeof(header) + header.chunks * sizeof(ChunkEntry) > size)
+            return false;
+        entries.resize(header.chunks);
+        std::memcpy(entries.data(), base + sizeof(header), entries.size() * sizeof(ChunkEntry));
+        primitive_count = header.primitives;
+        std::vector<Aabb> bounds;
+        for (const ChunkEntry &entry : entries)
+        {
+            if (entry.offset + entry.count * sizeof(Primitive) > size)
+                return false;
+            bounds.push_back(entry.bounds);
+        }
+        top.build(bounds);
+        return true;
+    }
+
+    // the chunk's primitives, paged in from the mapping (and its BVH built) unless already resident
+    std::shared_ptr<const ResidentChunk<Primitive>> page_in(const uint32_t chunk)
+    {
+        auto it = index.find(chunk);
+        if (it != index.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->resident;
+        }
+        const ChunkEntry &entry = entries[chunk];
+        std::shared_ptr<ResidentChunk<Primitive>> resident = std::make_shared<ResidentChunk<Primitive>>();
+        resident->primitives.resize(entry.count);
+        std::memcpy(resident->primitives.data(), base + entry.offset, entry.count * sizeof(Primitive));
+        // the copy is what counts against the budget; let the kernel drop the mapped pages again
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t first = entry.offset / page * page;
+        madvise(base + first, entry.offset + entry.count * sizeof(Primitive) - first, MADV_DONTNEED);
+        std::vector<Aabb> bounds(entry.count);
+        for (size_t i = 0; i < entry.count; i++)
+            resident->primitives[i].bounds(bounds[i].lo, bounds[i].hi);
+        resident->bvh.build(bounds);
+
+        page_ins++;
+        bytes_paged_in += entry.count * sizeof(Primitive);
+        resident_bytes += resident->bytes();
+        lru.push_front(Entry{chunk, resident});
+        index[chunk] = lru.begin();
+        while (resident_bytes > capacity && lru.size() > 1)
+        {
+            resident_bytes -= lru.back().resident->bytes();
+            index.erase(lru.back().chunk);
+            lru.pop_back();
+            evictions++;
+        }
+        peak_resident_bytes = std::max(peak_resident_bytes, resident_bytes);
+        return resident;
+    }
+
+    size_t chunk_count() const { return entries.size(); }
+    const ChunkEntry &entry(const uint32_t chunk) const { return entries[chunk]; }
+
+    void report(std::ostream &out) const
+    {
+        out << "out-of-core: " << primitive_count << " primitives in " << entries.size() << " chunks, " << size / (1024. * 1024.) << " MB file, "
+            << page_ins << " page-ins (" << bytes_paged_in / (1024. * 1024.) << " MB), " << skipped << " skipped, " << evictions
+            << " evictions, peak resident "
+            << peak_resident_bytes / (1024. * 1024.) << "/" << capacity / (1024. * 1024.) << " MB" << std::endl;
+    }
+
+    Bvh top; // over the chunk bounds
+    uint64_t page_ins = 0, evictions = 0, bytes_paged_in = 0;
+    uint64_t skipped = 0; // queued chunks none of whose rays could still reach them by the time they came up
+
+private:
+    struct Entry
+    {
+        uint32_t chunk;
+        std::shared_ptr<const ResidentChunk<Primitive>> resident;
+    };
+
+    size_t capacity;
+    size_t resident_bytes = 0, peak_resident_bytes = 0;
+    unsigned char *base = nullptr;
+    size_t size = 0;
+    uint64_t primitive_count = 0;
+    std::vector<ChunkEntry> entries;
+    std::list<Entry> lru;
+    std::unordered_map<uint32_t, typename std::list<Entry>::iterator> index;
+};
+
+// a ray of a batch; hits copy the primitive out so it stays usable after its chunk is evicted
+template <typename Primitive>
+struct QueuedRay
+{
+    vec3 orig, dir;
+    float tmax;
+    bool hit = false;
+    Primitive primitive;
+};
+
+// closest hits (or, with any_hit, occlusion within tmax) for a whole batch of rays.
+// Chunks are visited nearest to near_point first so that closest-hit rays shrink tmax early; before a chunk
+// is paged in its queue is checked again against the current tmax (and, with any_hit, rays already occluded),
+// and a chunk no ray can still reach is not read at all.
+template <typename Primitive>
+void trace_batch(ChunkStore<Primitive> &store, std::vector<QueuedRay<Primitive>> &rays, const bool any_hit, const vec3 &near_point)
+{
+    std::vector<std::vector<uint32_t>> queues(store.chunk_count());
+    for (size_t r = 0; r < rays.size(); r++)
+    {
+        float tmax = rays[r].tmax;
+        store.top.traverse(rays[r].orig, rays[r].dir, tmax, [&](uint32_t chunk) {
+            queues[chunk].push_back(r);
+            return false;
+        });
+    }
+    std::vector<uint32_t> order;
+    std::vector<float> distance(queues.size());
+    for (uint32_t c = 0; c < queues.size(); c++)
+    {
+        if (queues[c].empty())
+            continue;
+        order.push_back(c);
+        vec3 d = store.entry(c).bounds.center() - near_point;
+        distance[c] = d * d;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return distance[a] < distance[b]; });
+
+    std::vector<uint32_t> queue;
+    for (uint32_t c : order)
+    {
+        const Aabb &bounds = store.entry(c).bounds;
+        queue.clear();
+        for (uint32_t r : queues[c])
+        {
+            const QueuedRay<Primitive> &ray = rays[r];
+            if (any_hit && ray.hit)
+                continue;
+            const vec3 inv_dir{1.f / ray.dir.x, 1.f / ray.dir.y, 1.f / ray.dir.z};
+            if (bounds.ray_intersect(ray.orig, inv_dir, ray.tmax))
+                queue.push_back(r);
+        }
+        if (queue.empty())
+        {
+            store.skipped++;
+            continue;
+        }
+        std::shared_ptr<const ResidentChunk<Primitive>> chunk = store.page_in(c);
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int q = 0; q < int(queue.size()); q++)
+        {
+            QueuedRay<Primitive> &ray = rays[queue[q]];
+            chunk->bvh.traverse(ray.orig, ray.dir, ray.tmax, [&](uint32_t i) {
+                float t;
+                if (chunk->primitives[i].ray_intersect(ray.orig, ray.dir, t) && t < ray.tmax)
+                {
+                    ray.tmax = t;
+                    ray.hit = true;
+                    ray.primitive = chunk->primitives[i];
+                    return any_hit;
+                }
+                return false;
+            });
+        }
+    }
+}
+
+#endif //__OUT_OF_CORE_H__
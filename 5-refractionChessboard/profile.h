@@ -0,0 +1,176 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+#include <string>
+
+// Scoped timers over the render stages, compiled in with -DTINYRAYTRACER_PROFILE (the CMake option of the
+// same name) and to nothing otherwise.
+//
+// PROFILE_SCOPE(name) records one event spanning the rest of the enclosing block, PROFILE_SCOPE_ARG(name, arg)
+// one that also carries an integer such as a tile index; name must be a string literal. Every thread writes
+// into a ring of its own, so recording takes two clock reads and a store: no lock, no allocation after the
+// thread's first event. Rings are pushed onto a lock-free list and handed to a later thread once theirs has
+// exited, which bounds memory when workers are short-lived; a full ring overwrites its oldest events.
+// write_chrome_trace() exports every ring as Chrome trace-event JSON (chrome://tracing, Perfetto) and must
+// only be called while no thread is recording.
+//
+// For perf: timestamps are CLOCK_MONOTONIC, the clock of `perf record -k CLOCK_MONOTONIC`, so the trace lines
+// up with perf samples, and where <sys/sdt.h> exists every scope is also a pair of USDT probes,
+// tinyraytracer:scope_begin and scope_end(name, arg), for perf probe or bpftrace. A perf map would add
+// nothing: there is no generated code, perf resolves everything from the binary's symbols.
+
+#ifdef TINYRAYTRACER_PROFILE
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <time.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROFILE_USDT
+#endif
+#endif
+
+const bool PROFILE_ENABLED = true;
+
+struct ProfileEvent
+{
+    const char *name;
+    int64_t arg; // -1 for none
+    uint64_t begin, end;
+};
+
+struct ProfileRing
+{
+    static const size_t EVENTS = 1 << 16;
+    uint32_t id = 0;
+    std::atomic<bool> owned{true};
+    uint64_t written = 0; // events ever recorded; the ring holds the last min(written, EVENTS)
+    ProfileRing *next = nullptr;
+    ProfileEvent events[EVENTS];
+};
+
+std::atomic<ProfileRing *> profile_rings{nullptr};
+std::atomic<uint32_t> profile_ring_count{0};
+
+inline uint64_t profile_now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+}
+
+// the calling thread's ring: a released one if there is any, a new one otherwise
+inline ProfileRing &profile_ring()
+{
+    struct Owner
+    {
+        ProfileRing *ring = nullptr;
+        ~Owner()
+        {
+            if (ring)
+                ring->owned.store(false, std::memory_order_release);
+        }
+    };
+    thread_local Owner owner;
+    if (!owner.ring)
+    {
+        for (ProfileRing *r = profile_rings.load(std::memory_order_acquire); r && !owner.ring; r = r->next)
+        {
+            bool free = false;
+            if (r->owned.compare_exchange_strong(free, true, std::memory_order_acquire))
+                owner.ring = r;
+        }
+        if (!owner.ring)
+        {
+            owner.ring = new ProfileRing(); // never freed: the export may come after the thread is gone
+            owner.ring->id = profile_ring_count++;
+            owner.ring->next = profile_rings.load(std::memory_order_relaxed);
+            while (!profile_rings.compare_exchange_weak(owner.ring->next, owner.ring, std::memory_order_release))
+                ;
+        }
+    }
+    return *owner.ring;
+}
+
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char *scope_name, const int64_t scope_arg = -1) : name(scope_name), arg(scope_arg)
+    {
+#ifdef PROFILE_USDT
+        DTRACE_PROBE2(tinyraytracer, scope_begin, name, arg);
+#endif
+        begin = profile_now();
+    }
+
+    ~ProfileScope()
+    {
+        uint64_t end = profile_now();
+        ProfileRing &ring = profile_ring();
+        ring.events[ring.written++ % ProfileRing::EVENTS] = ProfileEvent{name, arg, begin, end};
+#ifdef PROFILE_USDT
+        DTRACE_PROBE2(tinyraytracer, scope_end, name, arg);
+#endif
+    }
+
+private:
+    const char *name;
+    int64_t arg;
+    uint64_t begin;
+};
+
+// writes every recorded event, times in microseconds from the first one; overwritten counts the events lost
+// to full rings. Returns the number of events written, or 0 if the file could not be written.
+size_t write_chrome_trace(const std::string &filename, size_t &overwritten)
+{
+    std::ofstream ofs(filename);
+    uint64_t origin = UINT64_MAX;
+    for (ProfileRing *r = profile_rings.load(); r; r = r->next)
+        for (size_t i = 0; i < std::min<uint64_t>(r->written, ProfileRing::EVENTS); i++)
+            origin = std::min(origin, r->events[i].begin);
+    size_t events = 0;
+    overwritten = 0;
+    ofs << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    for (ProfileRing *r = profile_rings.load(); r; r = r->next)
+    {
+        ofs << (r == profile_rings.load() ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << r->id
+            << ",\"args\":{\"name\":\"thread " << r->id << "\"}}";
+        overwritten += r->written - std::min<uint64_t>(r->written, ProfileRing::EVENTS);
+        for (uint64_t i = r->written - std::min<uint64_t>(r->written, ProfileRing::EVENTS); i < r->written; i++)
+        {
+            const ProfileEvent &e = r->events[i % ProfileRing::EVENTS];
+            ofs << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << r->id << ",\"ts\":" << (e.begin - origin) / 1e3
+                << ",\"dur\":" << (e.end - e.begin) / 1e3;
+            if (e.arg >= 0)
+                ofs << ",\"args\":{\"arg\":" << e.arg << "}";
+            ofs << "}";
+            events++;
+        }
+    }
+    ofs << "\n]}\n";
+    return ofs ? events : 0;
+}
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_JOIN(profile_scope_, __LINE__)(name)
+#define PROFILE_SCOPE_ARG(name, arg) ProfileScope PROFILE_JOIN(profile_scope_, __LINE__)(name, arg)
+
+#else
+
+const bool PROFILE_ENABLED = false;
+
+inline size_t write_chrome_trace(const std::string &, size_t &overwritten)
+{
+    overwritten = 0;
+    return 0;
+}
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_SCOPE_ARG(name, arg)
+
+#endif
+
+#endif //__PROFILE_H__
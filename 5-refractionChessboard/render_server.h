@@ -0,0 +1,124 @@
+#ifndef __RENDER_SERVER_H__
+#define __RENDER_SERVER_H__
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+typedef std::chrono::steady_clock render_clock;
+
+struct Camera
+{
+    vec3 position;
+    float fov = M_PI / 3.0;
+};
+
+struct RenderJob
+{
+    size_t id = 0;
+    int priority = 0;
+    std::string output;
+    int width = 1024;
+    int height = 768;
+    int spp = 1;
+    Camera camera;
+    render_clock::time_point submitted;
+};
+
+// limits on a job, so that one bad line cannot overflow the pixel count or exhaust memory
+const int MAX_JOB_SIDE = 16384;
+const long long MAX_JOB_PIXELS = 1 << 26; // 768 MB of framebuffer
+const int MAX_JOB_SPP = 4096;
+
+// job line: <output.ppm> <width> <height> <spp> <cam_x> <cam_y> <cam_z> [priority]
+bool parse_job(const std::string &line, RenderJob &job)
+{
+    std::istringstream in(line);
+    if (!(in >> job.output >> job.width >> job.height >> job.spp >> job.camera.position.x >> job.camera.position.y >> job.camera.position.z))
+        return false;
+    if (!(in >> job.priority))
+        job.priority = 0;
+    return job.width > 0 && job.height > 0 && job.spp > 0 && job.width <= MAX_JOB_SIDE && job.height <= MAX_JOB_SIDE &&
+           (long long)job.width * job.height <= MAX_JOB_PIXELS && job.spp <= MAX_JOB_SPP;
+}
+
+// higher priority first, submission order within the same priority
+struct JobOrder
+{
+    bool operator()(const RenderJob &a, const RenderJob &b) const
+    {
+        return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+    }
+};
+
+class JobQueue
+{
+public:
+    void push(const RenderJob &job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push(job);
+        }
+        ready.notify_one();
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        ready.notify_all();
+    }
+
+    // blocks until a job is available; returns false once the queue is closed and drained
+    bool pop(RenderJob &job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return closed || !jobs.empty(); });
+        if (jobs.empty())
+            return false;
+        job = jobs.top();
+        jobs.pop();
+        return true;
+    }
+
+private:
+    std::priority_queue<RenderJob, std::vector<RenderJob>, JobOrder> jobs;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool closed = false;
+};
+
+double elapsed_ms(render_clock::time_point from, render_clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+struct LatencyStats
+{
+    std::vector<double> total_ms;
+
+    void add(double ms) { total_ms.push_back(ms); }
+
+    void report(std::ostream &out)
+    {
+        if (total_ms.empty())
+            return;
+        std::sort(total_ms.begin(), total_ms.end());
+        double sum = 0;
+        for (double ms : total_ms)
+            sum += ms;
+        size_t n = total_ms.size();
+        out << "jobs=" << n << " mean=" << sum / n << "ms p50=" << total_ms[n / 2]
+            << "ms p95=" << total_ms[std::min(n - 1, n * 95 / 100)] << "ms max=" << total_ms.back() << "ms" << std::endl;
+    }
+};
+
+#endif //__RENDER_SERVER_H__
@@ -0,0 +1,90 @@
+#ifndef __TEMPORAL_H__
+#define __TEMPORAL_H__
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "aov.h"
+#include "geometry.h"
+#include "render_server.h"
+
+// Frame-to-frame reuse for a moving camera.
+//
+// A frame keeps, per pixel, the colour it ended up with and what its primary ray hit. The next frame
+// still casts one primary ray per pixel, projects the hit into the previous camera and reuses the colour
+// found there when that pixel saw the same surface: same object, a depth within depth_tolerance of the
+// expected one, a normal within normal_tolerance and the same albedo, so that texture edges such as the
+// checkerboard's do not bleed. Everything else is traced in full: disocclusions, hits that left the previous
+// view, view-dependent surfaces (any specular, reflective or refractive term) and a rotating 1/refresh_period
+// of the pixels. Reuse takes the nearest pixel, which is off by up to half a pixel; a colour is carried
+// forward at most max_reuse times before it is shaded again, so that this error does not compound. A freshly
+// shaded pixel starts at a per-pixel count in [0, max_reuse) so that the expiries spread over frames.
+struct TemporalSettings
+{
+    int refresh_period = 8;
+    int max_reuse = 2;
+    float depth_tolerance = 0.01;  // relative
+    float normal_tolerance = 0.95; // minimum cosine
+    float albedo_tolerance = 0.02; // per component
+};
+
+struct TemporalCache
+{
+    int width = 0, height = 0;
+    Camera camera;
+    uint32_t frame = 0;
+    bool valid = false;
+    std::vector<vec3> color, normal, albedo;
+    std::vector<float> depth;
+    std::vector<uint32_t> object;
+    std::vector<uint8_t> reuses; // frames the colour has been carried forward since it was shaded
+
+    void resize(const int w, const int h)
+    {
+        width = w;
+        height = h;
+        color.assign(size_t(w) * h, vec3{0, 0, 0});
+        normal.assign(size_t(w) * h, vec3{0, 0, 0});
+        albedo.assign(size_t(w) * h, vec3{0, 0, 0});
+        depth.assign(size_t(w) * h, 0);
+        object.assign(size_t(w) * h, NO_ID);
+        reuses.assign(size_t(w) * h, 0);
+        valid = false;
+    }
+
+    // pixel of the cached frame that saw the world point p, or -1 outside its view
+    long project(const vec3 &p) const
+    {
+        vec3 v = p - camera.position;
+        if (v.z >= 0)
+            return -1;
+        const float f = height / (2 * std::tan(camera.fov / 2));
+        float x = width / 2.f + v.x * f / -v.z;
+        float y = height / 2.f - v.y * f / -v.z;
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            return -1;
+        return long(x) + long(y) * width;
+    }
+
+    // the colour the cached frame has for a primary hit at p, if it saw the same surface there and has not
+    // been reused too often; uses is how often the colour will have been carried forward
+    bool lookup(const vec3 &p, const FirstHit &hit, const TemporalSettings &settings, vec3 &c, uint8_t &uses) const
+    {
+        if (!valid || hit.object == NO_ID)
+            return false;
+        long q = project(p);
+        if (q < 0 || object[q] != hit.object || reuses[q] >= settings.max_reuse)
+            return false;
+        float expected = (p - camera.position).norm();
+        if (std::fabs(depth[q] - expected) > settings.depth_tolerance * expected || normal[q] * hit.normal < settings.normal_tolerance)
+            return false;
+        const vec3 &a = albedo[q];
+        if (std::fabs(a.x - hit.albedo.x) > settings.albedo_tolerance || std::fabs(a.y - hit.albedo.y) > settings.albedo_tolerance ||
+            std::fabs(a.z - hit.albedo.z) > settings.albedo_tolerance)
+            return false;
+        c = color[q];
+        uses = reuses[q] + 1;
+        return true;
+    }
+};
+
+#endif //__TEMPORAL_H__
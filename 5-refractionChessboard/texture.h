@@ -0,0 +1,107 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include "geometry.h"
+#include "texture_cache.h"
+
+// where a texture is looked up: the world-space hit point, the primitive's surface parametrization
+// and the footprint of the ray there
+struct TextureSample
+{
+    vec3 point;
+    float u = 0, v = 0;
+    float footprint = 0; // width of the ray cone at the hit in (u, v) units, 0 for an unfiltered lookup
+};
+
+// Texture nodes are evaluated lazily, once per closest hit, and may reference other nodes as inputs.
+// They are owned by the Scene and shared between materials.
+struct Texture
+{
+    virtual ~Texture() {}
+    virtual vec3 eval(const TextureSample &s) const = 0;
+};
+
+struct ConstantTexture : Texture
+{
+    vec3 color;
+
+    ConstantTexture(const vec3 &c) : color(c) {}
+    vec3 eval(const TextureSample &) const { return color; }
+};
+
+// alternates two inputs on a grid of 1/scale sized cells in (u, v)
+struct CheckerTexture : Texture
+{
+    const Texture *even, *odd;
+    float scale;
+
+    CheckerTexture(const Texture *e, const Texture *o, const float &s) : even(e), odd(o), scale(s) {}
+    vec3 eval(const TextureSample &s) const
+    {
+        int parity = int(std::floor(scale * s.u)) + int(std::floor(scale * s.v));
+        return parity & 1 ? odd->eval(s) : even->eval(s);
+    }
+};
+
+// blends two inputs along a world-space axis between from and to
+struct GradientTexture : Texture
+{
+    const Texture *a, *b;
+    vec3 axis;
+    float from, to;
+
+    GradientTexture(const Texture *ta, const Texture *tb, const vec3 &ax, const float &f, const float &t) : a(ta), b(tb), axis(ax), from(f), to(t) {}
+    vec3 eval(const TextureSample &s) const
+    {
+        float k = std::max(0.f, std::min(1.f, (s.point * axis - from) / (to - from)));
+        return a->eval(s) * (1 - k) + b->eval(s) * k;
+    }
+};
+
+// image from a tiled mip file (see texture_cache.h), repeated over (u, v).
+// Lookups are trilinear: the mip level follows the ray footprint so that distant or minified
+// surfaces read from small levels and touch few tiles.
+struct ImageTexture : Texture
+{
+    const TiledImage *image;
+    TextureCache *cache;
+
+    ImageTexture(const TiledImage *i, TextureCache *c) : image(i), cache(c) {}
+
+    vec3 eval(const TextureSample &s) const
+    {
+        float lod = s.footprint > 0 ? std::log2(s.footprint * std::max(image->width(0), image->height(0))) : 0;
+        lod = std::max(0.f, std::min(float(image->levels() - 1), lod));
+        int level = int(lod);
+        float f = lod - level;
+        vec3 c = bilinear(level, s.u, s.v);
+        if (f > 0 && level + 1 < image->levels())
+            c = c * (1 - f) + bilinear(level + 1, s.u, s.v) * f;
+        return c;
+    }
+
+    vec3 texel(const int level, const int x, const int y) const
+    {
+        const int tile = image->tile();
+        std::shared_ptr<const TextureTile> t = cache->fetch(*image, level, x / tile, y / tile);
+        const float *rgb = &t->rgb[((x % tile) + (y % tile) * tile) * 3];
+        return vec3{rgb[0], rgb[1], rgb[2]};
+    }
+
+    vec3 bilinear(const int level, const float u, const float v) const
+    {
+        const int width = image->width(level), height = image->height(level);
+        float x = (u - std::floor(u)) * width - 0.5f;
+        float y = (v - std::floor(v)) * height - 0.5f;
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        float fx = x - x0, fy = y - y0;
+        int x1 = (x0 + 1) % width, y1 = (y0 + 1) % height;
+        x0 = (x0 + width) % width;
+        y0 = (y0 + height) % height;
+        return (texel(level, x0, y0) * (1 - fx) + texel(level, x1, y0) * fx) * (1 - fy) + (texel(level, x0, y1) * (1 - fx) + texel(level, x1, y1) * fx) * fy;
+    }
+};
+
+#endif //__TEXTURE_H__
@@ -0,0 +1,262 @@
+#ifndef __TEXTURE_CACHE_H__
+#define __TEXTURE_CACHE_H__
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tiled, mipmapped texture files and a bounded LRU cache of decoded tiles.
+//
+// File layout: TiledImageHeader, then every mip level (0 = full resolution) as a row-major grid of
+// tile x tile RGB8 tiles; edge tiles are padded to full size. Files are memory-mapped and a tile is
+// only decoded into the cache when a lookup needs it.
+struct TiledImageHeader
+{
+    char magic[8];
+    uint32_t width, height, tile, levels;
+};
+
+const char TILED_IMAGE_MAGIC[8] = {'T', 'R', 'T', 'M', 'I', 'P', '0', '1'};
+
+bool read_ppm(const std::string &filename, int &width, int &height, std::vector<unsigned char> &rgb)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    std::string magic;
+    int maxval;
+    ifs >> magic >> width >> height >> maxval;
+    ifs.get();
+    if (!ifs || magic != "P6" || width <= 0 || height <= 0 || maxval != 255)
+        return false;
+    rgb.resize(width * height * 3);
+    return bool(ifs.read(reinterpret_cast<char *>(rgb.data()), rgb.size()));
+}
+
+// converts a binary PPM into the tiled mip file format, box-filtering each level from the previous one
+bool write_tiled_image(const std::string &ppm, const std::string &filename, const uint32_t tile = 32)
+{
+    int width, height;
+    std::vector<unsigned char> level;
+    if (!read_ppm(ppm, width, height, level))
+        return false;
+    std::ofstream ofs(filename, std::ios::binary);
+    TiledImageHeader header;
+    std::memcpy(header.magic, TILED_IMAGE_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.tile = tile;
+    header.levels = 1;
+    for (uint32_t w = width, h = height; w > 1 || h > 1; w = std::max(1u, w / 2), h = std::max(1u, h / 2))
+        header.levels++;
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::vector<unsigned char> tile_rgb(tile * tile * 3);
+    for (uint32_t l = 0, w = width, h = height; l < header.levels; l++)
+    {
+        for (uint32_t ty = 0; ty < (h + tile - 1) / tile; ty++)
+            for (uint32_t tx = 0; tx < (w + tile - 1) / tile; tx++)
+            {
+                std::fill(tile_rgb.begin(), tile_rgb.end(), 0);
+                for (uint32_t y = 0; y < tile && ty * tile + y < h; y++)
+                    for (uint32_t x = 0; x < tile && tx * tile + x < w; x++)
+                        std::memcpy(&tile_rgb[(x + y * tile) * 3], &level[((tx * tile + x) + (ty * tile + y) * w) * 3], 3);
+                ofs.write(reinterpret_cast<const char *>(tile_rgb.data()), tile_rgb.size());
+            }
+
+        uint32_t nw = std::max(1u, w / 2), nh = std::max(1u, h / 2);
+        std::vector<unsigned char> next(nw * nh * 3);
+        for (uint32_t y = 0; y < nh; y++)
+            for (uint32_t x = 0; x < nw; x++)
+                for (uint32_t c = 0; c < 3; c++)
+                {
+                    uint32_t x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                    uint32_t y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                    next[(x + y * nw) * 3 + c] = (level[(x0 + y0 * w) * 3 + c] + level[(x1 + y0 * w) * 3 + c] + level[(x0 + y1 * w) * 3 + c] + level[(x1 + y1 * w) * 3 + c] + 2) / 4;
+                }
+        level.swap(next);
+        w = nw;
+        h = nh;
+    }
+    return bool(ofs);
+}
+
+class TiledImage
+{
+public:
+    TiledImage() {}
+    TiledImage(const TiledImage &) = delete;
+    TiledImage &operator=(const TiledImage &) = delete;
+    ~TiledImage()
+    {
+        if (base)
+            munmap(base, size);
+    }
+
+    bool open(const std::string &filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(TiledImageHeader))
+        {
+            size = st.st_size;
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            base = p == MAP_FAILED ? nullptr : static_cast<unsigned char *>(p);
+        }
+        ::close(fd);
+        if (!base)
+            return false;
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, TILED_IMAGE_MAGIC, sizeof(header.magic)) || !header.tile || header.levels > 32)
+            return false;
+        size_t offset = sizeof(header);
+        for (uint32_t l = 0; l < header.levels; l++)
+        {
+            level_offset.push_back(offset);
+            offset += size_t(tiles_x(l)) * tiles_y(l) * tile_bytes();
+        }
+        static std::atomic<uint32_t> next_id(0);
+        id = next_id++;
+        return offset <= size;
+    }
+
+    int width(const int level) const { return std::max(1u, header.width >> level); }
+    int height(const int level) const { return std::max(1u, header.height >> level); }
+    int levels() const { return header.levels; }
+    int tile() const { return header.tile; }
+    int tiles_x(const int level) const { return (width(level) + header.tile - 1) / header.tile; }
+    int tiles_y(const int level) const { return (height(level) + header.tile - 1) / header.tile; }
+    size_t tile_bytes() const { return size_t(header.tile) * header.tile * 3; }
+
+    const unsigned char *tile_data(const int level, const int tx, const int ty) const
+    {
+        return base + level_offset[level] + (size_t(tx) + size_t(ty) * tiles_x(level)) * tile_bytes();
+    }
+
+    uint32_t id = 0;
+
+private:
+    TiledImageHeader header = TiledImageHeader();
+    unsigned char *base = nullptr;
+    size_t size = 0;
+    std::vector<size_t> level_offset;
+};
+
+// one decoded tile, linear float RGB
+struct TextureTile
+{
+    std::vector<float> rgb;
+};
+
+// LRU cache of decoded tiles bounded by capacity bytes, shared by all render threads.
+// Tiles are handed out as shared pointers so that an eviction never pulls data from under a lookup.
+class TextureCache
+{
+public:
+    explicit TextureCache(const size_t capacity_bytes) : capacity(capacity_bytes) {}
+
+    std::shared_ptr<const TextureTile> fetch(const TiledImage &image, const int level, const int tx, const int ty)
+    {
+        // 5 bits of level cover the 32 that TiledImage::open() accepts
+        const uint64_t key = uint64_t(image.id) << 53 | uint64_t(level) << 48 | uint64_t(ty) << 24 | uint64_t(tx);
+        // consecutive lookups of a thread mostly land in the same tile; serve those without the lock
+        thread_local const TextureCache *last_cache = nullptr;
+        thread_local uint64_t last_key = 0;
+        thread_local std::shared_ptr<const TextureTile> last_tile;
+        if (last_cache == this && last_key == key && last_tile)
+        {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return last_tile;
+        }
+
+        std::shared_ptr<const TextureTile> tile;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end())
+            {
+                lru.splice(lru.begin(), lru, it->second);
+                tile = it->second->tile;
+                hits.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if (!tile)
+        {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            tile = load(image, level, tx, ty);
+            insert(key, tile);
+        }
+        last_cache = this;
+        last_key = key;
+        last_tile = tile;
+        return tile;
+    }
+
+    void report(std::ostream &out) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t h = hits, m = misses;
+        out << "texture cache: " << h + m << " lookups, " << h << " hits, " << m << " misses ("
+            << (h + m ? 100. * h / (h + m) : 0.) << "% hit rate), " << evictions << " evictions, "
+            << resident / (1024. * 1024.) << "/" << capacity / (1024. * 1024.) << " MB resident" << std::endl;
+    }
+
+    std::atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        std::shared_ptr<const TextureTile> tile;
+    };
+
+    size_t tile_size(const TextureTile &tile) const { return tile.rgb.size() * sizeof(float); }
+
+    // decoding happens outside the lock; the pages of the mapping are faulted in here
+    std::shared_ptr<const TextureTile> load(const TiledImage &image, const int level, const int tx, const int ty) const
+    {
+        std::shared_ptr<TextureTile> tile = std::make_shared<TextureTile>();
+        const unsigned char *src = image.tile_data(level, tx, ty);
+        tile->rgb.resize(image.tile_bytes());
+        for (size_t i = 0; i < tile->rgb.size(); i++)
+            tile->rgb[i] = src[i] * (1.f / 255);
+        return tile;
+    }
+
+    void insert(const uint64_t key, const std::shared_ptr<const TextureTile> &tile)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.count(key)) // another thread loaded it meanwhile
+            return;
+        lru.push_front(Entry{key, tile});
+        index[key] = lru.begin();
+        resident += tile_size(*tile);
+        while (resident > capacity && lru.size() > 1)
+        {
+            resident -= tile_size(*lru.back().tile);
+            index.erase(lru.back().key);
+            lru.pop_back();
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity;
+    size_t resident = 0;
+    std::list<Entry> lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    mutable std::mutex mutex;
+};
+
+#endif //__TEXTURE_CACHE_H__
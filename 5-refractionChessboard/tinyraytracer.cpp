@@ -1,6 +1,22 @@
 #include "geometry.h"
+#include "aov.h"
+#include "bvh.h"
+#include "denoise.h"
+#include "incremental.h"
+#include "numa.h"
+#include "out_of_core.h"
+#include "profile.h"
+#include "render_server.h"
+#include "temporal.h"
+#include "texture.h"
+#include "tonemap.h"
 
+#include <cstdint>
 #include <fstream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 #include <limits>
 
@@ -19,15 +35,17 @@ struct Material
     vec4 albedo;
     vec3 diffuse_color;
     float specular_exponent;
+    const Texture *texture = nullptr; // replaces diffuse_color at the closest hit when set
 };
 
 struct Sphere
 {
     vec3 center;
     float radius;
-    Material material;
+    uint32_t material; // index into Scene::materials
 
-    Sphere(const vec3 &c, const float &r, const Material &m) : center(c), radius(r), material(m) {}
+    Sphere() : radius(0), material(0) {}
+    Sphere(const vec3 &c, const float &r, const uint32_t &m) : center(c), radius(r), material(m) {}
 
     bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const
     {
@@ -45,6 +63,436 @@ struct Sphere
             return false;
         return true;
     }
+
+    void bounds(vec3 &bmin, vec3 &bmax) const
+    {
+        bmin = center - vec3{radius, radius, radius};
+        bmax = center + vec3{radius, radius, radius};
+    }
+
+    void surface(const vec3 &p, const float width, vec3 &N, TextureSample &s) const
+    {
+        N = (p - center).normalize();
+        s.u = 0.5f + atan2f(N.z, N.x) / (2 * M_PI);
+        s.v = 0.5f - asinf(std::max(-1.f, std::min(1.f, N.y))) / M_PI;
+        s.footprint = width / (M_PI * radius);
+    }
+};
+
+// plane normal * p = offset, optionally clipped to [bmin, bmax] (the checkerboard is such a rectangle);
+// (u, v) are the coordinates along u_axis and v_axis
+struct Plane
+{
+    vec3 normal;
+    float offset;
+    vec3 u_axis, v_axis;
+    uint32_t material;
+    vec3 bmin{-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()};
+    vec3 bmax{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+
+    Plane(const vec3 &n, const float &o, const vec3 &u, const vec3 &v, const uint32_t &m) : normal(n), offset(o), u_axis(u), v_axis(v), material(m) {}
+
+    Plane &clip(const vec3 &lo, const vec3 &hi)
+    {
+        bmin = lo;
+        bmax = hi;
+        return *this;
+    }
+
+    bool bounded() const { return bmin.x > -std::numeric_limits<float>::max(); }
+
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const
+    {
+        float denom = normal * dir;
+        if (std::abs(denom) <= 1e-3) // avoid division by zero
+            return false;
+        t0 = (offset - normal * orig) / denom;
+        if (t0 <= 1e-3)
+            return false;
+        vec3 pt = orig + dir * t0; // flat axes of the clip box are not tested, the hit lies in the plane anyway
+        return inside(pt.x, bmin.x, bmax.x) && inside(pt.y, bmin.y, bmax.y) && inside(pt.z, bmin.z, bmax.z);
+    }
+
+    static bool inside(const float p, const float lo, const float hi) { return lo == hi || (p > lo && p < hi); }
+
+    void bounds(vec3 &lo, vec3 &hi) const
+    {
+        lo = bmin - vec3{1e-3, 1e-3, 1e-3};
+        hi = bmax + vec3{1e-3, 1e-3, 1e-3};
+    }
+
+    void surface(const vec3 &p, const float width, vec3 &N, TextureSample &s) const
+    {
+        N = normal;
+        s.u = p * u_axis;
+        s.v = p * v_axis;
+        s.footprint = width * sqrtf(std::max(u_axis * u_axis, v_axis * v_axis));
+    }
+};
+
+struct Box
+{
+    vec3 bmin, bmax;
+    uint32_t material;
+
+    Box(const vec3 &lo, const vec3 &hi, const uint32_t &m) : bmin(lo), bmax(hi), material(m) {}
+
+    bool ray_intersect(const vec3 &orig, const vec3 &dir, float &t0) const
+    {
+        float tn = -std::numeric_limits<float>::max(), tf = std::numeric_limits<float>::max();
+        for (size_t a = 0; a < 3; a++)
+        {
+            float t1 = (bmin[a] - orig[a]) / dir[a];
+            float t2 = (bmax[a] - orig[a]) / dir[a];
+            tn = std::max(tn, std::min(t1, t2));
+            tf = std::min(tf, std::max(t1, t2));
+        }
+        if (tn > tf || tf < 0)
+            return false;
+        t0 = tn < 0 ? tf : tn; // from the inside the exit face is hit, like Sphere
+        return true;
+    }
+
+    void bounds(vec3 &lo, vec3 &hi) const
+    {
+        lo = bmin;
+        hi = bmax;
+    }
+
+    void surface(const vec3 &p, const float width, vec3 &N, TextureSample &s) const
+    {
+        vec3 c = (bmin + bmax) * 0.5f, half = (bmax - bmin) * 0.5f;
+        size_t axis = 0;
+        float best = 0;
+        for (size_t a = 0; a < 3; a++)
+        {
+            float d = std::abs(p[a] - c[a]) / half[a];
+            if (d > best)
+            {
+                best = d;
+                axis = a;
+            }
+        }
+        N = vec3{0, 0, 0};
+        N[axis] = p[axis] > c[axis] ? 1 : -1;
+        s.u = p[(axis + 1) % 3];
+        s.v = p[(axis + 2) % 3];
+        s.footprint = width;
+    }
+};
+
+// geometry placed many times: spheres in object space with their own (bottom-level) BVH
+struct Prototype
+{
+    std::vector<Sphere> spheres;
+    Bvh bvh;
+
+    void build()
+    {
+        std::vector<Aabb> bounds;
+        vec3 lo, hi;
+        for (const Sphere &sphere : spheres)
+        {
+            sphere.bounds(lo, hi);
+            bounds.push_back(Aabb(lo, hi));
+        }
+        bvh.build(bounds);
+    }
+
+    // closest sphere along an object-space ray with a unit direction, nearer than tmax
+    bool intersect(const vec3 &orig, const vec3 &dir, float &tmax, uint32_t &sphere) const
+    {
+        bool hit = false;
+        bvh.traverse(orig, dir, tmax, [&](uint32_t i) {
+            float t;
+            if (spheres[i].ray_intersect(orig, dir, t) && t < tmax)
+            {
+                tmax = t;
+                sphere = i;
+                hit = true;
+            }
+            return false;
+        });
+        return hit;
+    }
+};
+
+// a placed copy of a prototype; instances sit in the scene BVH (the top level) next to plain primitives
+struct Instance
+{
+    uint32_t prototype;
+    Affine to_world, to_object;
+
+    Instance(const uint32_t &p, const Affine &m) : prototype(p), to_world(m), to_object(m.inverse()) {}
+
+    Aabb bounds(const Aabb &object) const
+    {
+        Aabb box;
+        for (int c = 0; c < 8; c++)
+            box.grow(to_world.point(vec3{c & 1 ? object.hi.x : object.lo.x, c & 2 ? object.hi.y : object.lo.y, c & 4 ? object.hi.z : object.lo.z}));
+        return box;
+    }
+};
+
+struct PrimRef
+{
+    enum Kind
+    {
+        SPHERE,
+        PLANE,
+        BOX,
+        INSTANCE
+    };
+    Kind kind;
+    uint32_t index;
+};
+
+struct Scene
+{
+    std::vector<Sphere> spheres;
+    std::vector<Plane> planes;
+    std::vector<Box> boxes;
+    std::vector<Prototype> prototypes;
+    std::vector<Instance> instances;
+    std::vector<Light> lights;
+    std::vector<Material> materials;
+    std::vector<std::unique_ptr<Texture>> textures; // texture nodes referenced by the materials
+
+    std::vector<PrimRef> prims;      // payload of the BVH leaves
+    std::vector<uint32_t> unbounded; // infinite planes, tested against every ray
+    Bvh bvh;
+
+    const Texture *add_texture(Texture *texture)
+    {
+        textures.emplace_back(texture);
+        return texture;
+    }
+
+    uint32_t add_material(const Material &material)
+    {
+        materials.push_back(material);
+        return materials.size() - 1;
+    }
+
+    // a copy of everything but the textures, which stay owned by (and shared with) this scene
+    Scene replica() const
+    {
+        Scene copy;
+        copy.spheres = spheres;
+        copy.planes = planes;
+        copy.boxes = boxes;
+        copy.prototypes = prototypes;
+        copy.instances = instances;
+        copy.lights = lights;
+        copy.materials = materials;
+        copy.prims = prims;
+        copy.unbounded = unbounded;
+        copy.bvh = bvh;
+        return copy;
+    }
+
+    // (re)builds the acceleration structure; call after adding or removing primitives
+    void build()
+    {
+        PROFILE_SCOPE("acceleration build");
+        prims.clear();
+        unbounded.clear();
+        for (size_t i = 0; i < spheres.size(); i++)
+            prims.push_back(PrimRef{PrimRef::SPHERE, uint32_t(i)});
+        for (size_t i = 0; i < planes.size(); i++)
+            if (planes[i].bounded())
+                prims.push_back(PrimRef{PrimRef::PLANE, uint32_t(i)});
+            else
+                unbounded.push_back(i);
+        for (size_t i = 0; i < boxes.size(); i++)
+            prims.push_back(PrimRef{PrimRef::BOX, uint32_t(i)});
+        for (Prototype &prototype : prototypes)
+            prototype.build();
+        for (size_t i = 0; i < instances.size(); i++)
+            if (!prototypes[instances[i].prototype].bvh.nodes.empty())
+                prims.push_back(PrimRef{PrimRef::INSTANCE, uint32_t(i)});
+        bvh.build(prim_bounds());
+    }
+
+    // after primitives moved (none added or removed): refits the BVH, and rebuilds it instead once refitting
+    // has let its SAH cost grow past max_cost_ratio times that of the last build. Returns true if it rebuilt.
+    bool update(const float max_cost_ratio = BVH_REBUILD_RATIO)
+    {
+        PROFILE_SCOPE("acceleration update");
+        std::vector<Aabb> bounds = prim_bounds();
+        bvh.refit(bounds);
+        if (!bvh.needs_rebuild(max_cost_ratio))
+            return false;
+        bvh.build(bounds);
+        return true;
+    }
+
+    // bounds of every entry of prims
+    std::vector<Aabb> prim_bounds() const
+    {
+        std::vector<Aabb> bounds(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+        {
+            const PrimRef &ref = prims[i];
+            switch (ref.kind)
+            {
+            case PrimRef::SPHERE:
+                spheres[ref.index].bounds(bounds[i].lo, bounds[i].hi);
+                break;
+            case PrimRef::PLANE:
+                planes[ref.index].bounds(bounds[i].lo, bounds[i].hi);
+                break;
+            case PrimRef::BOX:
+                boxes[ref.index].bounds(bounds[i].lo, bounds[i].hi);
+                break;
+            default:
+                bounds[i] = instances[ref.index].bounds(prototypes[instances[ref.index].prototype].bvh.nodes[0].box);
+            }
+        }
+        return bounds;
+    }
+
+    // distance to the primitive along the ray; instances only report hits nearer than tmax and
+    // return the prototype sphere they hit in sub
+    bool intersect(const PrimRef &ref, const vec3 &orig, const vec3 &dir, const float tmax, float &t, uint32_t &sub) const
+    {
+        switch (ref.kind)
+        {
+        case PrimRef::SPHERE:
+            return spheres[ref.index].ray_intersect(orig, dir, t);
+        case PrimRef::PLANE:
+            return planes[ref.index].ray_intersect(orig, dir, t);
+        case PrimRef::BOX:
+            return boxes[ref.index].ray_intersect(orig, dir, t);
+        default:
+        {
+            const Instance &instance = instances[ref.index];
+            vec3 d = instance.to_object.vector(dir);
+            float scale = d.norm(); // object-space length of a unit world step
+            float t_object = tmax * scale;
+            if (!prototypes[instance.prototype].intersect(instance.to_object.point(orig), d * (1 / scale), t_object, sub))
+                return false;
+            t = t_object / scale;
+            return true;
+        }
+        }
+    }
+
+    uint32_t material_of(const PrimRef &ref, const uint32_t sub) const
+    {
+        switch (ref.kind)
+        {
+        case PrimRef::SPHERE:
+            return spheres[ref.index].material;
+        case PrimRef::PLANE:
+            return planes[ref.index].material;
+        case PrimRef::BOX:
+            return boxes[ref.index].material;
+        default:
+            return prototypes[instances[ref.index].prototype].spheres[sub].material;
+        }
+    }
+
+    // objects numbered spheres first, then planes, boxes and instances
+    uint32_t object_of(const PrimRef &ref) const
+    {
+        switch (ref.kind)
+        {
+        case PrimRef::SPHERE:
+            return ref.index;
+        case PrimRef::PLANE:
+            return spheres.size() + ref.index;
+        case PrimRef::BOX:
+            return spheres.size() + planes.size() + ref.index;
+        default:
+            return spheres.size() + planes.size() + boxes.size() + ref.index;
+        }
+    }
+
+    // shading data of the closest hit; textures are only evaluated here, filtered over the ray cone width at the hit
+    void resolve(const PrimRef &ref, const uint32_t sub, const vec3 &hit, const float width, vec3 &N, Material &material) const
+    {
+        TextureSample s;
+        s.point = hit;
+        switch (ref.kind)
+        {
+        case PrimRef::SPHERE:
+            spheres[ref.index].surface(hit, width, N, s);
+            break;
+        case PrimRef::PLANE:
+            planes[ref.index].surface(hit, width, N, s);
+            break;
+        case PrimRef::BOX:
+            boxes[ref.index].surface(hit, width, N, s);
+            break;
+        default:
+        {
+            const Instance &instance = instances[ref.index];
+            vec3 n;
+            prototypes[instance.prototype].spheres[sub].surface(instance.to_object.point(hit), width, n, s);
+            N = instance.to_object.normal(n).normalize();
+        }
+        }
+        material = materials[material_of(ref, sub)];
+        if (material.texture)
+            material.diffuse_color = material.texture->eval(s);
+    }
+};
+
+// when cast_ray stops following reflection and refraction
+struct PathSettings
+{
+    size_t max_depth = 4;        // rays deeper than this return the background
+    float min_contribution = 0;  // secondary rays whose path weight is not above this are dropped (biased unless 0)
+    bool roulette = false;       // Russian roulette on low-weight paths, unbiased
+    size_t roulette_depth = 1;   // first depth at which roulette may terminate a path
+    float roulette_weight = 0.5; // paths weighted below this survive with probability weight / roulette_weight
+};
+
+const PathSettings default_path_settings;
+
+// rays traced per depth, for judging what path termination saves
+struct RayCounts
+{
+    static const size_t DEPTHS = 16; // the last bucket takes every deeper ray as well
+    uint64_t rays[DEPTHS] = {};
+    uint64_t shadow_rays[DEPTHS] = {};
+
+    void add(const RayCounts &other)
+    {
+        for (size_t d = 0; d < DEPTHS; d++)
+        {
+            rays[d] += other.rays[d];
+            shadow_rays[d] += other.shadow_rays[d];
+        }
+    }
+
+    uint64_t total() const
+    {
+        uint64_t n = 0;
+        for (size_t d = 0; d < DEPTHS; d++)
+            n += rays[d] + shadow_rays[d];
+        return n;
+    }
+};
+
+// per-ray-tree state threaded through cast_ray; every member is optional
+struct TraceContext
+{
+    TileDeps *deps = nullptr; // segments of this tile's rays, see incremental.h
+    float spread = 0;         // ray cone growth per unit distance (one pixel), drives texture filtering
+    const PathSettings *path = &default_path_settings;
+    RayCounts counts;
+    uint32_t rng = 1; // xorshift state, seeded per pixel sample so that results do not depend on scheduling
+    FirstHit *first_hit = nullptr; // filled in, then detached, by the first scene_intersect of a sample
+
+    float random()
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        return (rng >> 8) * (1.f / 16777216.f);
+    }
 };
 
 vec3 reflect(const vec3 &I, const vec3 &N)
@@ -69,65 +517,124 @@ vec3 refract(const vec3 &I, const vec3 &N, const float &refractive_index)
     return k < 0 ? vec3{0, 0, 0} : I * eta + n * (eta * cosi - sqrtf(k));
 }
 
-bool scene_intersect(const vec3 &orig, const vec3 &dir, const std::vector<Sphere> &spheres, vec3 &hit, vec3 &N, Material &material)
+// cone, when given, is the ray cone width at orig and becomes the width at the hit
+bool scene_intersect(const vec3 &orig, const vec3 &dir, const Scene &scene, vec3 &hit, vec3 &N, Material &material, TraceContext *ctx = nullptr, float *cone = nullptr)
 {
-    float spheres_dist = std::numeric_limits<float>::max();
-    for (size_t i = 0; i < spheres.size(); i++)
-    {
+    float dist = std::numeric_limits<float>::max();
+    PrimRef nearest;
+    uint32_t nearest_sub = 0;
+    auto closest = [&](const PrimRef &ref) {
         float dist_i;
-        if (spheres[i].ray_intersect(orig, dir, dist_i) && dist_i < spheres_dist)
+        uint32_t sub = 0;
+        if (scene.intersect(ref, orig, dir, dist, dist_i, sub) && dist_i < dist)
         {
-            spheres_dist = dist_i;
-            hit = orig + dir * dist_i;
-            N = (hit - spheres[i].center).normalize();
-            material = spheres[i].material;
+            dist = dist_i;
+            nearest = ref;
+            nearest_sub = sub;
         }
-    }
+    };
+    scene.bvh.traverse(orig, dir, dist, [&](uint32_t prim) {
+        closest(scene.prims[prim]);
+        return false;
+    });
+    for (uint32_t plane : scene.unbounded)
+        closest(PrimRef{PrimRef::PLANE, plane});
 
-    float checkerboard_dist = std::numeric_limits<float>::max();
-    if (std::abs(dir.y) > 1e-3)
-    {                                    // avoid division by zero
-        float d = -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
-        vec3 pt = orig + dir * d;
-        if (d > 1e-3 && fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30 && d < spheres_dist)
+    if (ctx && ctx->deps)
+        ctx->deps->add(orig, dir, dist, dist < 1000 ? scene.object_of(nearest) : NO_ID);
+    if (dist >= 1000)
+    {
+        if (ctx && ctx->first_hit)
         {
-            checkerboard_dist = d;
-            hit = pt;
-            N = vec3{0, 1, 0};
-            material.diffuse_color = (int(.5 * hit.x + 1000) + int(.5 * hit.z)) & 1 ? vec3{.3, .3, .3} : vec3{.3, .2, .1};
+            *ctx->first_hit = FirstHit{vec3{0, 0, 0}, vec3{0.2, 0.7, 0.8}, 1000, NO_ID, NO_ID};
+            ctx->first_hit = nullptr;
         }
+        return false;
     }
+    hit = orig + dir * dist;
+    float width = cone ? *cone + (ctx ? ctx->spread : 0) * dist : 0;
+    scene.resolve(nearest, nearest_sub, hit, width, N, material);
+    if (cone)
+        *cone = width;
+    if (ctx && ctx->first_hit)
+    {
+        *ctx->first_hit = FirstHit{N, material.diffuse_color, dist, scene.material_of(nearest, nearest_sub), scene.object_of(nearest)};
+        ctx->first_hit = nullptr;
+    }
+    return true;
+}
+
+// any-hit query for shadow rays: is there anything closer than max_dist?
+bool scene_occluded(const vec3 &orig, const vec3 &dir, const float max_dist, const Scene &scene, TraceContext *ctx = nullptr)
+{
+    float dist = max_dist;
+    bool occluded = false;
+    auto any = [&](const PrimRef &ref) {
+        float dist_i;
+        uint32_t sub = 0;
+        if (scene.intersect(ref, orig, dir, dist, dist_i, sub) && dist_i < dist)
+        {
+            dist = dist_i;
+            occluded = true;
+        }
+        return occluded;
+    };
+    scene.bvh.traverse(orig, dir, dist, [&](uint32_t prim) { return any(scene.prims[prim]); });
+    for (size_t i = 0; i < scene.unbounded.size() && !occluded; i++)
+        any(PrimRef{PrimRef::PLANE, scene.unbounded[i]});
 
-    return std::min(spheres_dist, checkerboard_dist) < 1000;
+    if (ctx && ctx->deps)
+        ctx->deps->add(orig, dir, dist);
+    return occluded;
 }
 
-vec3 cast_ray(const vec3 &orig, const vec3 &dir, const std::vector<Sphere> &spheres, const std::vector<Light> &lights, size_t depth = 0)
+// how a secondary ray with the given path weight continues: 0 drops it, otherwise its colour is scaled by the result
+float path_continuation(const float weight, const size_t depth, TraceContext *ctx)
 {
-    vec3 point, N;
-    Material material;
+    const PathSettings &path = ctx ? *ctx->path : default_path_settings;
+    if (weight <= path.min_contribution)
+        return 0;
+    if (!ctx || !path.roulette || depth < path.roulette_depth || weight >= path.roulette_weight)
+        return 1;
+    float survive = weight / path.roulette_weight;
+    return ctx->random() < survive ? 1 / survive : 0;
+}
 
-    if (depth > 4 || !scene_intersect(orig, dir, spheres, point, N, material))
+// weight is the path throughput: the factor this ray's colour ends up with in the pixel
+vec3 cast_ray(const vec3 &orig, const vec3 &dir, const Scene &scene, size_t depth = 0, TraceContext *ctx = nullptr, float cone = 0, float weight = 1);
+
+// colour of a ray along dir that hit point: the secondary rays and the lights
+vec3 shade(const vec3 &dir, const vec3 &point, const vec3 &N, const Material &material, const Scene &scene, size_t depth, TraceContext *ctx, float cone, float weight)
+{
+    vec3 reflect_color{0, 0, 0}, refract_color{0, 0, 0};
+    float reflect_weight = weight * material.albedo[2];
+    float reflect_scale = path_continuation(reflect_weight, depth + 1, ctx);
+    if (reflect_scale > 0)
     {
-        return vec3{0.2, 0.7, 0.8}; // background color
+        vec3 reflect_dir = reflect(dir, N).normalize();
+        vec3 reflect_orig = point + N * 1e-3; // offset the original point to avoid occlusion by the object itself
+        reflect_color = cast_ray(reflect_orig, reflect_dir, scene, depth + 1, ctx, cone, reflect_weight * reflect_scale) * reflect_scale;
     }
 
-    vec3 reflect_dir = reflect(dir, N).normalize();
-    vec3 reflect_orig = point + N*1e-3; // offset the original point to avoid occlusion by the object itself
-    vec3 reflect_color = cast_ray(reflect_orig, reflect_dir, spheres, lights, depth + 1);
-
-    vec3 refract_dir = refract(dir, N, material.refractive_index).normalize();
-    vec3 refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
-    vec3 refract_color = cast_ray(refract_orig, refract_dir, spheres, lights, depth + 1);
+    float refract_weight = weight * material.albedo[3];
+    float refract_scale = path_continuation(refract_weight, depth + 1, ctx);
+    if (refract_scale > 0)
+    {
+        vec3 refract_dir = refract(dir, N, material.refractive_index).normalize();
+        vec3 refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+        refract_color = cast_ray(refract_orig, refract_dir, scene, depth + 1, ctx, cone, refract_weight * refract_scale) * refract_scale;
+    }
 
     float diffuse_light_intensity = 0, specular_light_intensity = 0;
+    const std::vector<Light> &lights = scene.lights;
     for (size_t i = 0; i < lights.size(); i++)
     {
         vec3 light_dir = (lights[i].position - point).normalize();
         float light_distance = (lights[i].position - point).norm();
         vec3 shadow_orig = light_dir * N < 0 ? point : point + N * 1e-3; // checking if the point lies in the shadow of the lights[i]
-        vec3 shadow_pt, shadow_N;
-        Material tmpmaterial;
-        if (scene_intersect(shadow_orig, light_dir, spheres, shadow_pt, shadow_N, tmpmaterial) && (shadow_pt - shadow_orig).norm() < light_distance)
+        if (ctx)
+            ctx->counts.shadow_rays[std::min(depth, RayCounts::DEPTHS - 1)]++;
+        if (scene_occluded(shadow_orig, light_dir, light_distance, scene, ctx))
             continue;
 
         diffuse_light_intensity += lights[i].intensity * std::max(0.f, light_dir * N);
@@ -136,61 +643,1148 @@ vec3 cast_ray(const vec3 &orig, const vec3 &dir, const std::vector<Sphere> &sphe
     return material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1] + reflect_color * material.albedo[2] + refract_color * material.albedo[3];
 }
 
-void render(const std::vector<Sphere> &spheres, const std::vector<Light> &lights)
+vec3 cast_ray(const vec3 &orig, const vec3 &dir, const Scene &scene, size_t depth, TraceContext *ctx, float cone, float weight)
 {
-    const int width = 1024;
-    const int height = 768;
-    const float fov = M_PI / 3.0;
-    std::vector<vec3> framebuffer(width * height);
+    vec3 point, N;
+    Material material;
+    const PathSettings &path = ctx ? *ctx->path : default_path_settings;
 
-    for (size_t j = 0; j < height; j++)
+    if (depth > path.max_depth)
+        return vec3{0.2, 0.7, 0.8}; // background color
+    if (ctx)
+        ctx->counts.rays[std::min(depth, RayCounts::DEPTHS - 1)]++;
+    if (!scene_intersect(orig, dir, scene, point, N, material, ctx, &cone))
     {
-        for (size_t i = 0; i < width; i++)
+        return vec3{0.2, 0.7, 0.8}; // background color
+    }
+    return shade(dir, point, N, material, scene, depth, ctx, cone, weight);
+}
+
+// per-sample jitter; spp == 1 keeps the classic pixel-centre ray
+uint32_t sample_hash(uint32_t pixel, uint32_t sample, uint32_t axis)
+{
+    uint32_t h = pixel * 0x9E3779B1u ^ (sample * 0x85EBCA77u + axis * 0xC2B2AE3Du);
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+float sample_offset(uint32_t pixel, uint32_t sample, uint32_t axis)
+{
+    return (sample_hash(pixel, sample, axis) >> 8) * (1.f / 16777216.f);
+}
+
+const int TILE_SIZE = 16;
+
+int tile_count(const int width, const int height)
+{
+    return ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+// the mean of the pixel's spp samples; with hits the first hit of every sample is folded into it
+vec3 render_pixel(const int i, const int j, const int width, const int height, const int spp, const Camera &camera, const Scene &scene,
+                  TraceContext &ctx, PixelHits *hits = nullptr)
+{
+    const float z = -height / (2. * tan(camera.fov / 2.));
+    vec3 c{0, 0, 0};
+    FirstHit first;
+    for (int s = 0; s < spp; s++)
+    {
+        float dx = spp == 1 ? 0.5f : sample_offset(i + j * width, s, 0);
+        float dy = spp == 1 ? 0.5f : sample_offset(i + j * width, s, 1);
+        float x = (i + dx) - width / 2.;
+        float y = -(j + dy) + height / 2.;
+        vec3 dir = vec3{x, y, z}.normalize();
+        ctx.rng = sample_hash(i + j * width, s, 2) | 1;
+        ctx.first_hit = hits ? &first : nullptr;
+        c = c + cast_ray(camera.position, dir, scene, 0, &ctx);
+        if (hits)
+            hits->add(first);
+    }
+    return c * (1.f / spp);
+}
+
+// traces every tile, or only those flagged in dirty; with a cache the traced tiles re-record their dependencies,
+// and when dirty is given only their stale pixels (see DependencyCache::invalidate) are traced again; with guides the first hits are kept for the denoiser and with aovs every finished tile goes to the AOV file
+void render(std::vector<vec3> &framebuffer, const int width, const int height, const int spp, const Camera &camera, const Scene &scene,
+            const PathSettings &path, RayCounts *counts = nullptr, DependencyCache *cache = nullptr, const std::vector<char> *dirty = nullptr,
+            GuideBuffers *guides = nullptr, AovWriter *aovs = nullptr)
+{
+    framebuffer.resize(width * height);
+    if (guides)
+    {
+        if (guides->width != width || guides->height != height)
+            guides->resize(width, height);
+        guides->spp = spp;
+    }
+    const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles = tile_count(width, height);
+    if (cache)
+        cache->resize(tiles);
+    PROFILE_SCOPE("render");
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < tiles; t++)
+    {
+        if (dirty && !(*dirty)[t])
+            continue;
+        PROFILE_SCOPE_ARG("tile", t);
+        TraceContext ctx;
+        ctx.spread = 2 * tan(camera.fov / 2.) / height;
+        ctx.path = &path;
+        if (cache)
         {
-            float x = (i + 0.5) - width / 2.;
-            float y = -(j + 0.5) + height / 2.;
-            float z = -height / (2. * tan(fov / 2.));
-            vec3 dir = vec3{x, y, z}.normalize();
-            framebuffer[i + j * width] = cast_ray(vec3{0, 0, 0}, dir, spheres, lights);
+            ctx.deps = &cache->tiles[t];
+            ctx.deps->begin();
         }
+        const int x0 = (t % tiles_x) * TILE_SIZE, y0 = (t / tiles_x) * TILE_SIZE;
+        const int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, height);
+        std::vector<AovPixel> tile_aovs(aovs ? (x1 - x0) * (y1 - y0) : 0);
+        for (int j = y0; j < y1; j++)
+        {
+            for (int i = x0; i < x1; i++)
+            {
+                if (cache && dirty && !ctx.deps->stale[(i - x0) + (j - y0) * (x1 - x0)])
+                {
+                    ctx.deps->keep();
+                    continue;
+                }
+                PixelHits hits;
+                uint64_t rays = aovs && aovs->enabled(AOV_RAYS) ? ctx.counts.total() : 0;
+                framebuffer[i + j * width] = render_pixel(i, j, width, height, spp, camera, scene, ctx, guides || aovs ? &hits : nullptr);
+                if (guides)
+                    guides->set(i + j * width, hits.mean());
+                if (aovs)
+                {
+                    AovPixel &p = tile_aovs[(i - x0) + (j - y0) * (x1 - x0)];
+                    p.color = framebuffer[i + j * width];
+                    p.hit = hits.mean();
+                    p.rays = aovs->enabled(AOV_RAYS) ? ctx.counts.total() - rays : 0;
+                }
+                if (cache)
+                    ctx.deps->end_pixel();
+            }
+        }
+        if (cache)
+            ctx.deps->end();
+        if (aovs)
+            aovs->write_tile(x0, y0, x1 - x0, y1 - y0, tile_aovs);
+        if (counts)
+        {
+#pragma omp critical
+            counts->add(ctx.counts);
+        }
+    }
+}
+
+// one sample per pixel like render(), but pixels whose primary hit the previous frame in cache already shaded
+// take that colour instead of being traced further (see temporal.h); cache then holds this frame.
+// Returns the number of reused pixels.
+size_t render_temporal(std::vector<vec3> &framebuffer, const int width, const int height, const Camera &camera, const Scene &scene,
+                       const PathSettings &path, TemporalCache &cache, const TemporalSettings &settings, RayCounts *counts = nullptr)
+{
+    framebuffer.resize(width * height);
+    if (cache.width != width || cache.height != height)
+        cache.resize(width, height);
+    TemporalCache next;
+    next.resize(width, height);
+    next.camera = camera;
+    next.frame = cache.frame + 1;
+    const float z = -height / (2. * tan(camera.fov / 2.));
+    size_t reused = 0;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : reused)
+    for (int j = 0; j < height; j++)
+    {
+        TraceContext ctx;
+        ctx.spread = 2 * tan(camera.fov / 2.) / height;
+        ctx.path = &path;
+        for (int i = 0; i < width; i++)
+        {
+            const size_t p = i + j * width;
+            vec3 dir = vec3{(i + 0.5f) - width / 2.f, -(j + 0.5f) + height / 2.f, z}.normalize();
+            vec3 point, N, c;
+            Material material;
+            FirstHit hit;
+            float cone = 0;
+            uint8_t uses = 0;
+            ctx.rng = sample_hash(p, 0, 2) | 1;
+            ctx.first_hit = &hit;
+            ctx.counts.rays[0]++;
+            bool refresh = (sample_hash(p, 0, 3) + cache.frame) % settings.refresh_period == 0;
+            if (!scene_intersect(camera.position, dir, scene, point, N, material, &ctx, &cone))
+                c = vec3{0.2, 0.7, 0.8}; // background color
+            else if (!refresh && material.albedo[1] == 0 && material.albedo[2] == 0 && material.albedo[3] == 0 &&
+                     cache.lookup(point, hit, settings, c, uses))
+                reused++;
+            else
+            {
+                c = shade(dir, point, N, material, scene, 0, &ctx, cone, 1);
+                // a staggered start, so that the colours shaded in one frame do not all expire in the same later one
+                if (settings.max_reuse > 0)
+                    uses = sample_hash(p, next.frame, 5) % settings.max_reuse;
+            }
+            framebuffer[p] = c;
+            next.color[p] = c;
+            next.normal[p] = hit.normal;
+            next.albedo[p] = hit.albedo;
+            next.depth[p] = hit.depth;
+            next.object[p] = hit.object;
+            next.reuses[p] = uses;
+        }
+        if (counts)
+        {
+#pragma omp critical
+            counts->add(ctx.counts);
+        }
+    }
+    next.valid = true;
+    cache = std::move(next);
+    return reused;
+}
+
+// per-node copies of the scene, each made by a thread pinned to a CPU of its node so that the copy lands in
+// that node's memory; the replicas share the textures of scene, which must outlive them
+std::vector<std::unique_ptr<Scene>> replicate_scene(const Scene &scene, const std::vector<WorkerPlacement> &workers)
+{
+    std::vector<std::unique_ptr<Scene>> replicas(worker_nodes(workers));
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < replicas.size(); n++)
+    {
+        int cpu = std::find_if(workers.begin(), workers.end(), [n](const WorkerPlacement &w) { return w.node == int(n); })->cpu;
+        threads.emplace_back([&scene, &replicas, n, cpu] {
+            pin_thread(cpu);
+            replicas[n].reset(new Scene(scene.replica()));
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+    return replicas;
+}
+
+// render() on one pinned thread per worker. Tiles are kept in tiles, in one range per node when node_local
+// (see numa.h) or all on the first node otherwise, and every worker traces scenes[its node], or scenes[0]
+// when there is a single scene. node_counts gets the rays traced by the workers of each node and
+// stolen the tiles rendered outside their node's range. Returns false, having rendered nothing, if the tile
+// ranges could not be mapped.
+bool render_numa(std::vector<vec3> &framebuffer, const int width, const int height, const int spp, const Camera &camera,
+                 const std::vector<const Scene *> &scenes, const PathSettings &path, const std::vector<WorkerPlacement> &workers,
+                 NodeFramebuffer &tiles, const bool node_local, std::vector<RayCounts> *node_counts = nullptr, size_t *stolen = nullptr)
+{
+    const int nodes = worker_nodes(workers);
+    const int ranges = node_local ? nodes : 1;
+    const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    std::vector<int> rank(workers.size()), node_workers(nodes, 0);
+    for (size_t w = 0; w < workers.size(); w++)
+        rank[w] = node_workers[workers[w].node]++;
+
+    if (!tiles.allocated() || tiles.node_count() != ranges || tiles.tile_count() != tile_count(width, height))
+    {
+        tiles.allocate(ranges, tile_count(width, height), TILE_SIZE * TILE_SIZE);
+        if (!tiles.allocated())
+            return false;
+        std::vector<std::thread> threads;
+        for (size_t w = 0; w < workers.size(); w++)
+            if (workers[w].node < ranges)
+                threads.emplace_back([&, w] {
+                    pin_thread(workers[w].cpu);
+                    tiles.touch(workers[w].node, rank[w], node_workers[workers[w].node]);
+                });
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    PROFILE_SCOPE("render");
+    NodeTileQueue queue(tiles);
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+    if (node_counts)
+        node_counts->assign(nodes, RayCounts());
+    for (size_t w = 0; w < workers.size(); w++)
+        threads.emplace_back([&, w] {
+            pin_thread(workers[w].cpu);
+            const int node = workers[w].node;
+            const Scene &scene = *scenes[scenes.size() > 1 ? node : 0];
+            TraceContext ctx;
+            ctx.spread = 2 * tan(camera.fov / 2.) / height;
+            ctx.path = &path;
+            size_t taken = 0;
+            int t;
+            while (queue.next(node % ranges, t, taken))
+            {
+                PROFILE_SCOPE_ARG("tile", t);
+                const int x0 = (t % tiles_x) * TILE_SIZE, y0 = (t / tiles_x) * TILE_SIZE;
+                const int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, height);
+                vec3 *pixels = tiles.tile(t);
+                for (int j = y0; j < y1; j++)
+                    for (int i = x0; i < x1; i++)
+                        pixels[(i - x0) + (j - y0) * TILE_SIZE] = render_pixel(i, j, width, height, spp, camera, scene, ctx);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (node_counts)
+                (*node_counts)[node].add(ctx.counts);
+            if (stolen)
+                *stolen += taken;
+        });
+    for (std::thread &t : threads)
+        t.join();
+
+    framebuffer.resize(width * height);
+    for (int t = 0; t < tiles.tile_count(); t++)
+    {
+        const int x0 = (t % tiles_x) * TILE_SIZE, y0 = (t / tiles_x) * TILE_SIZE;
+        const int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, height);
+        const vec3 *pixels = tiles.tile(t);
+        for (int j = y0; j < y1; j++)
+            std::copy(pixels + (j - y0) * TILE_SIZE, pixels + (j - y0) * TILE_SIZE + (x1 - x0), framebuffer.begin() + x0 + j * width);
     }
+    return true;
+}
 
+// false if the tone settings are unusable (see tonemap()), writing nothing, or if the file cannot be written
+bool save_ppm(const std::string &filename, const std::vector<vec3> &framebuffer, const int width, const int height, const ToneSettings &tone = ToneSettings())
+{
+    std::vector<unsigned char> bytes;
+    if (!tonemap(framebuffer, bytes, tone))
+        return false;
+    PROFILE_SCOPE("ppm write");
     std::ofstream ofs; // save the framebuffer to file
-    ofs.open("./outChessboardImage.ppm", std::ios::binary);
+    ofs.open(filename, std::ios::binary);
+    if (!ofs)
+        return false;
     ofs << "P6\n"
         << width << " " << height << "\n255\n";
-    for (size_t i = 0; i < height * width; ++i)
+    ofs.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    ofs.close();
+    return bool(ofs);
+}
+
+// long-running mode: the scene stays built and the OpenMP team stays alive between jobs,
+// jobs arrive one per line on stdin (see parse_job) and are served by priority
+void run_server(const Scene &scene, const PathSettings &path)
+{
+#pragma omp parallel
+    { // spin the worker team up once so the first job does not pay for it
+    }
+
+    JobQueue queue;
+    std::thread reader([&queue] {
+        std::string line;
+        size_t next_id = 0;
+        while (std::getline(std::cin, line))
+        {
+            if (line.empty() || line[0] == '#')
+                continue;
+            RenderJob job;
+            if (!parse_job(line, job))
+            {
+                std::cerr << "bad job: " << line << std::endl;
+                continue;
+            }
+            job.id = next_id++;
+            job.submitted = render_clock::now();
+            queue.push(job);
+        }
+        queue.close();
+    });
+
+    LatencyStats stats;
+    std::vector<vec3> framebuffer;
+    RenderJob job;
+    while (queue.pop(job))
     {
-        vec3 &c = framebuffer[i];
-        float max = std::max(c[0], std::max(c[1], c[2]));
-        if (max > 1)
-            c = c * (1. / max);
-        for (size_t j = 0; j < 3; j++)
+        render_clock::time_point started = render_clock::now(), rendered, written;
+        try
         {
-            ofs << (char)(255 * std::max(0.f, std::min(1.f, framebuffer[i][j])));
+            render(framebuffer, job.width, job.height, job.spp, job.camera, scene, path);
+            rendered = render_clock::now();
+            if (!save_ppm(job.output, framebuffer, job.width, job.height))
+            {
+                std::cout << "failed " << job.id << " " << job.output << ": cannot write" << std::endl;
+                continue;
+            }
+            written = render_clock::now();
         }
+        catch (const std::exception &e)
+        { // one failed job must not take the queued ones down with it
+            std::cout << "failed " << job.id << " " << job.output << ": " << e.what() << std::endl;
+            framebuffer = std::vector<vec3>();
+            continue;
+        }
+
+        stats.add(elapsed_ms(job.submitted, written));
+        std::cout << "done " << job.id << " " << job.output
+                  << " queue=" << elapsed_ms(job.submitted, started) << "ms"
+                  << " render=" << elapsed_ms(started, rendered) << "ms"
+                  << " write=" << elapsed_ms(rendered, written) << "ms"
+                  << " total=" << elapsed_ms(job.submitted, written) << "ms" << std::endl;
     }
-    ofs.close();
+    reader.join();
+    stats.report(std::cout);
 }
 
-int main()
+struct SceneEdit
 {
-    Material purpel_material(1.0, vec4{0.4, 0.3, 0.1, 0.0}, vec3{0.58, 0.44, 0.86}, 50);
-    Material red_material(1.0, vec4{0.3, 0.1, 0.0, 0.0}, vec3{1.0, 0.42, 0.42}, 10);
-    Material mirror(1.0, vec4{0.0, 10.0, 0.8, 0.0}, vec3{1.0, 1.0, 1.0}, 1425);
-    Material glass(1.5, vec4{0.0, 0.5, 0.1, 0.8}, vec3{0.6, 0.7, 0.8}, 125);
+    const char *name;
+    size_t sphere;
+    vec3 offset;
+    vec3 diffuse_color;
+};
 
-    std::vector<Sphere> spheres;
-    spheres.push_back(Sphere(vec3{-3, 0, -16}, 2, purpel_material));
-    spheres.push_back(Sphere(vec3{-1.0, -1.5, -12}, 2, glass));
-    spheres.push_back(Sphere(vec3{1.5, -0.5, -18}, 3, red_material));
-    spheres.push_back(Sphere(vec3{7, 5, -18}, 4, mirror));
+// look-dev loop: one recorded full render, then a few edits that re-trace only the tiles depending on them,
+// each timed against a plain full render of the edited scene
+void run_incremental(Scene &scene, const PathSettings &path)
+{
+    const int width = 1024;
+    const int height = 768;
+    std::vector<vec3> framebuffer, reference;
+    DependencyCache cache;
 
-    std::vector<Light> lights;
-    lights.push_back(Light(vec3{-20, 20, 20}, 1.5));
-    lights.push_back(Light(vec3{30, 50, -25}, 1.8));
-    lights.push_back(Light(vec3{30, 20, 30}, 1.7));
+    render_clock::time_point start = render_clock::now();
+    render(reference, width, height, 1, Camera(), scene, path);
+    render_clock::time_point plain = render_clock::now();
+    render(framebuffer, width, height, 1, Camera(), scene, path, nullptr, &cache);
+    std::cout << "full render: " << elapsed_ms(start, plain) << "ms, recording dependencies: " << elapsed_ms(plain, render_clock::now()) << "ms, "
+              << cache.tiles.size() << " tiles, " << cache.segments() << " segments (" << cache.segments() * sizeof(DepSegment) / (1024. * 1024.)
+              << " of at most " << cache.max_bytes / (1024. * 1024.) << " MB, " << sizeof(DepSegment) << " bytes per ray), " << cache.overflowed()
+              << " tiles over budget and always re-traced" << std::endl;
 
-    render(spheres, lights);
+    const SceneEdit edits[] = {
+        {"move glass", 1, vec3{0.5, 0, 0}, scene.materials[scene.spheres[1].material].diffuse_color},
+        {"recolor red", 2, vec3{0, 0, 0}, vec3{0.9, 0.3, 0.3}},
+        {"move mirror", 3, vec3{0, 1, 0}, scene.materials[scene.spheres[3].material].diffuse_color},
+    };
+    for (const SceneEdit &edit : edits)
+    {
+        Sphere &s = scene.spheres[edit.sphere];
+        vec3 old_min, old_max, new_min, new_max;
+        s.bounds(old_min, old_max);
+        s.center = s.center + edit.offset;
+        scene.materials[s.material].diffuse_color = edit.diffuse_color; // each sphere here has a material of its own
+        s.bounds(new_min, new_max);
+        scene.update();
+
+        std::vector<char> dirty;
+        RayCounts counts, full_counts;
+        start = render_clock::now();
+        const bool moved = edit.offset.x != 0 || edit.offset.y != 0 || edit.offset.z != 0;
+        size_t pixels = moved ? cache.invalidate(old_min, old_max, new_min, new_max, dirty)
+                              : cache.invalidate_object(scene.object_of(PrimRef{PrimRef::SPHERE, uint32_t(edit.sphere)}), dirty);
+        size_t retraced = std::count(dirty.begin(), dirty.end(), 1);
+        render(framebuffer, width, height, 1, Camera(), scene, path, &counts, &cache, &dirty);
+        render_clock::time_point incremental = render_clock::now();
+        render(reference, width, height, 1, Camera(), scene, path, &full_counts);
+        double incremental_ms = elapsed_ms(start, incremental), full_ms = elapsed_ms(incremental, render_clock::now());
+
+        float max_diff = 0;
+        for (size_t i = 0; i < framebuffer.size(); i++)
+            for (size_t c = 0; c < 3; c++)
+                max_diff = std::max(max_diff, std::abs(framebuffer[i][c] - reference[i][c]));
+        std::cout << edit.name << ": re-traced " << pixels << " pixels of " << retraced << "/" << dirty.size() << " tiles ("
+                  << 100. * counts.total() / full_counts.total() << "% of the rays) in " << incremental_ms << "ms (full render "
+                  << full_ms << "ms, " << full_ms / incremental_ms << "x), max diff vs full render " << max_diff << std::endl;
+    }
+    save_ppm("./outIncrementalImage.ppm", framebuffer, width, height);
+}
+
+void print_ray_counts(const RayCounts &counts)
+{
+    std::cout << "depth        rays  shadow rays" << std::endl;
+    for (size_t d = 0; d < RayCounts::DEPTHS; d++)
+        if (counts.rays[d] || counts.shadow_rays[d])
+            std::cout << std::setw(5) << (d + 1 < RayCounts::DEPTHS ? std::to_string(d) : std::to_string(d) + "+") << std::setw(12) << counts.rays[d]
+                      << std::setw(13) << counts.shadow_rays[d] << std::endl;
+    std::cout << "total " << counts.total() << std::endl;
+}
+
+// how much work each termination strategy removes on the current scene, against tracing every branch to max_depth
+void run_path_report(const Scene &scene, const PathSettings &base)
+{
+    const int width = 1024;
+    const int height = 768;
+    PathSettings full = base, skip_zero = base, cutoff = base, roulette = base;
+    full.min_contribution = -1;
+    full.roulette = false;
+    skip_zero.min_contribution = 0;
+    skip_zero.roulette = false;
+    cutoff.min_contribution = 0.05;
+    cutoff.roulette = false;
+    roulette.min_contribution = 0;
+    roulette.roulette = true;
+    const std::pair<const char *, PathSettings> variants[] = {
+        {"every branch", full},
+        {"skip zero weight", skip_zero},
+        {"cutoff 0.05", cutoff},
+        {"russian roulette", roulette},
+    };
+
+    std::vector<vec3> reference, framebuffer;
+    for (const auto &variant : variants)
+    {
+        RayCounts counts;
+        render_clock::time_point start = render_clock::now();
+        render(framebuffer, width, height, 1, Camera(), scene, variant.second, &counts);
+        double ms = elapsed_ms(start, render_clock::now());
+        if (reference.empty())
+            reference = framebuffer;
+        double err = 0;
+        for (size_t i = 0; i < framebuffer.size(); i++)
+            for (size_t c = 0; c < 3; c++)
+                err += (framebuffer[i][c] - reference[i][c]) * (framebuffer[i][c] - reference[i][c]);
+        std::cout << "== " << variant.first << ": " << ms << "ms, rmse vs every branch " << std::sqrt(err / (framebuffer.size() * 3)) << std::endl;
+        print_ray_counts(counts);
+    }
+}
+
+// a slow camera move over the chessboard: rays saved by temporal reuse in every frame, against
+// tracing the frame in full, and the error that reuse leaves
+void run_animation(const Scene &scene, const PathSettings &path, const int frames)
+{
+    const int width = 1024;
+    const int height = 768;
+    TemporalCache cache;
+    TemporalSettings settings;
+    std::vector<vec3> framebuffer, reference;
+    std::cout << "frame  reused %  rays  full rays  saved %  temporal ms  full ms    rmse" << std::endl;
+    for (int f = 0; f < frames; f++)
+    {
+        Camera camera;
+        camera.position = vec3{0.03f * f, 0.01f * f, -0.02f * f};
+        RayCounts counts, full_counts;
+        render_clock::time_point start = render_clock::now();
+        size_t reused = render_temporal(framebuffer, width, height, camera, scene, path, cache, settings, &counts);
+        render_clock::time_point traced = render_clock::now();
+        render(reference, width, height, 1, camera, scene, path, &full_counts);
+        render_clock::time_point full = render_clock::now();
+        double err = 0;
+        for (size_t i = 0; i < framebuffer.size(); i++)
+            for (size_t c = 0; c < 3; c++)
+                err += (framebuffer[i][c] - reference[i][c]) * (framebuffer[i][c] - reference[i][c]);
+        std::cout << std::setw(5) << f << std::setw(10) << 100. * reused / framebuffer.size() << std::setw(9) << counts.total()
+                  << std::setw(11) << full_counts.total() << std::setw(9) << 100. * (1 - double(counts.total()) / full_counts.total())
+                  << std::setw(13) << elapsed_ms(start, traced) << std::setw(9) << elapsed_ms(traced, full)
+                  << std::setw(12) << std::sqrt(err / (framebuffer.size() * 3)) << std::endl;
+    }
+    save_ppm("./outAnimationImage.ppm", framebuffer, width, height);
+}
+
+// throughput on the first 1, 2, ... nodes: one shared tile range and scene against node-local tiles and
+// per-node scene replicas, with the rays per second of every node
+void run_numa_bench(const Scene &scene, const PathSettings &path, const int frames)
+{
+    const int width = 1024;
+    const int height = 768;
+    std::vector<NumaNode> topology = numa_topology();
+    for (size_t n = 0; n < topology.size(); n++)
+    {
+        std::cout << "node " << topology[n].id << ":";
+        for (int cpu : topology[n].cpus)
+            std::cout << " " << cpu;
+        std::cout << std::endl;
+    }
+    std::vector<vec3> framebuffer;
+    std::cout << "nodes  workers  layout  ms/frame  Mrays/s  stolen tiles  Mrays/s per node" << std::endl;
+    for (size_t k = 1; k <= topology.size(); k++)
+    {
+        std::vector<WorkerPlacement> workers = place_workers(topology, k);
+        std::vector<std::unique_ptr<Scene>> replicas = replicate_scene(scene, workers);
+        std::vector<const Scene *> local_scenes;
+        for (const std::unique_ptr<Scene> &replica : replicas)
+            local_scenes.push_back(replica.get());
+        for (const bool local : {false, true})
+        {
+            NodeFramebuffer tiles;
+            std::vector<RayCounts> node_counts, frame_counts;
+            size_t stolen = 0;
+            const std::vector<const Scene *> scenes = local ? local_scenes : std::vector<const Scene *>{&scene};
+            if (!render_numa(framebuffer, width, height, 1, Camera(), scenes, path, workers, tiles, local)) // warm-up, and first touch
+            {
+                std::cerr << "cannot map the node-local framebuffer" << std::endl;
+                return;
+            }
+            render_clock::time_point start = render_clock::now();
+            for (int f = 0; f < frames; f++)
+            {
+                render_numa(framebuffer, width, height, 1, Camera(), scenes, path, workers, tiles, local, &frame_counts, &stolen);
+                node_counts.resize(frame_counts.size());
+                for (size_t n = 0; n < frame_counts.size(); n++)
+                    node_counts[n].add(frame_counts[n]);
+            }
+            double ms = elapsed_ms(start, render_clock::now());
+            uint64_t rays = 0;
+            for (const RayCounts &c : node_counts)
+                rays += c.total();
+            std::cout << std::setw(5) << k << std::setw(9) << workers.size() << std::setw(8) << (local ? "local" : "shared")
+                      << std::setw(10) << ms / frames << std::setw(9) << rays / (ms * 1e3) << std::setw(14) << double(stolen) / frames << " ";
+            for (const RayCounts &c : node_counts)
+                std::cout << " " << c.total() / (ms * 1e3);
+            std::cout << std::endl;
+        }
+    }
+}
+
+// PSNR per sample count against a converged render, before and after the denoiser. Paths end by
+// Russian roulette here so that low sample counts carry the noise the denoiser is meant for.
+void run_denoise_bench(const Scene &scene, const PathSettings &base)
+{
+    const int width = 512;
+    const int height = 384;
+    PathSettings noisy = base;
+    noisy.roulette = true;
+    std::vector<vec3> reference, framebuffer, denoised;
+    render_clock::time_point start = render_clock::now();
+    render(reference, width, height, 256, Camera(), scene, noisy);
+    std::cout << "reference: 256 spp, " << elapsed_ms(start, render_clock::now()) << "ms" << std::endl;
+    std::cout << "  spp   render ms   psnr dB   denoise ms   denoised psnr dB" << std::endl;
+    for (int spp = 1; spp <= 64; spp *= 2)
+    {
+        GuideBuffers guides;
+        start = render_clock::now();
+        render(framebuffer, width, height, spp, Camera(), scene, noisy, nullptr, nullptr, nullptr, &guides);
+        render_clock::time_point rendered = render_clock::now();
+        denoise(framebuffer, denoised, guides);
+        render_clock::time_point filtered = render_clock::now();
+        std::cout << std::setw(5) << spp << std::setw(12) << elapsed_ms(start, rendered) << std::setw(10) << psnr(framebuffer, reference)
+                  << std::setw(13) << elapsed_ms(rendered, filtered) << std::setw(19) << psnr(denoised, reference) << std::endl;
+    }
+}
+
+// a field of small spheres, far more than the in-core scene is meant to hold
+std::vector<Sphere> build_sphere_field(const size_t count)
+{
+    std::vector<Sphere> field;
+    field.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        vec3 center{-60 + 120 * sample_offset(i, 0, 0), -4 + 34 * sample_offset(i, 0, 1), -10 - 190 * sample_offset(i, 0, 2)};
+        field.push_back(Sphere(center, 0.06f + 0.14f * sample_offset(i, 0, 3), sample_hash(i, 0, 4) % 4));
+    }
+    return field;
+}
+
+// renders a sphere field from a chunk file (see out_of_core.h) with a bounded resident set:
+// primary rays go out as one batch, then one batch of shadow rays for the hits. Shading is the
+// local diffuse + specular part of cast_ray; reflection and refraction are not traced in this mode.
+void run_out_of_core(const size_t count, const size_t cache_mb)
+{
+    const int width = 1024;
+    const int height = 768;
+    const std::string filename = "./spheres" + std::to_string(count) + ".ooc";
+    if (!std::ifstream(filename))
+    { // written once; later runs only map it
+        render_clock::time_point start = render_clock::now();
+        if (!write_chunk_file(filename, build_sphere_field(count), 4096))
+        {
+            std::cerr << "cannot write " << filename << std::endl;
+            return;
+        }
+        std::cout << "wrote " << filename << " in " << elapsed_ms(start, render_clock::now()) << "ms" << std::endl;
+    }
+    ChunkStore<Sphere> store(cache_mb << 20);
+    if (!store.open(filename))
+    {
+        std::cerr << "cannot read " << filename << std::endl;
+        return;
+    }
+
+    const Material materials[] = {
+        Material(1.0, vec4{0.6, 0.3, 0, 0}, vec3{0.4, 0.4, 0.3}, 50),
+        Material(1.0, vec4{0.9, 0.1, 0, 0}, vec3{0.3, 0.1, 0.1}, 10),
+        Material(1.0, vec4{0.6, 0.3, 0, 0}, vec3{0.58, 0.44, 0.86}, 50),
+        Material(1.0, vec4{0.9, 0.1, 0, 0}, vec3{0.2, 0.55, 0.2}, 30),
+    };
+    const std::vector<Light> lights = {Light(vec3{-20, 20, 20}, 1.5), Light(vec3{30, 50, -25}, 1.8), Light(vec3{30, 20, 30}, 1.7)};
+    const Camera camera;
+    const float z = -height / (2. * tan(camera.fov / 2.));
+
+    render_clock::time_point start = render_clock::now();
+    std::vector<QueuedRay<Sphere>> rays(width * height);
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+        {
+            QueuedRay<Sphere> &ray = rays[i + j * width];
+            ray.orig = camera.position;
+            ray.dir = vec3{(i + 0.5f) - width / 2.f, -(j + 0.5f) + height / 2.f, z}.normalize();
+            ray.tmax = 1000;
+        }
+    trace_batch(store, rays, false, camera.position);
+    render_clock::time_point primary = render_clock::now();
+    uint64_t primary_page_ins = store.page_ins;
+
+    std::vector<QueuedRay<Sphere>> shadows;
+    std::vector<uint32_t> first_shadow(rays.size());
+    for (size_t p = 0; p < rays.size(); p++)
+    {
+        first_shadow[p] = shadows.size();
+        if (!rays[p].hit)
+            continue;
+        vec3 point = rays[p].orig + rays[p].dir * rays[p].tmax;
+        vec3 N = (point - rays[p].primitive.center).normalize();
+        for (const Light &light : lights)
+        {
+            QueuedRay<Sphere> shadow;
+            shadow.dir = (light.position - point).normalize();
+            shadow.orig = shadow.dir * N < 0 ? point : point + N * 1e-3;
+            shadow.tmax = (light.position - point).norm();
+            shadows.push_back(shadow);
+        }
+    }
+    trace_batch(store, shadows, true, camera.position);
+    render_clock::time_point shadowed = render_clock::now();
+
+    std::vector<vec3> framebuffer(rays.size());
+#pragma omp parallel for
+    for (int p = 0; p < int(rays.size()); p++)
+    {
+        const QueuedRay<Sphere> &ray = rays[p];
+        if (!ray.hit)
+        {
+            framebuffer[p] = vec3{0.2, 0.7, 0.8}; // background color
+            continue;
+        }
+        const Material &material = materials[ray.primitive.material];
+        vec3 point = ray.orig + ray.dir * ray.tmax;
+        vec3 N = (point - ray.primitive.center).normalize();
+        float diffuse_light_intensity = 0, specular_light_intensity = 0;
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            const QueuedRay<Sphere> &shadow = shadows[first_shadow[p] + i];
+            if (shadow.hit)
+                continue;
+            diffuse_light_intensity += lights[i].intensity * std::max(0.f, shadow.dir * N);
+            specular_light_intensity += powf(std::max(0.f, reflect(shadow.dir, N) * ray.dir), material.specular_exponent) * lights[i].intensity;
+        }
+        framebuffer[p] = material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3{1., 1., 1.} * specular_light_intensity * material.albedo[1];
+    }
+    save_ppm("./outOutOfCoreImage.ppm", framebuffer, width, height);
+
+    std::cout << rays.size() << " primary rays: " << elapsed_ms(start, primary) << "ms, " << primary_page_ins << " page-ins" << std::endl
+              << shadows.size() << " shadow rays: " << elapsed_ms(primary, shadowed) << "ms, " << store.page_ins - primary_page_ins << " page-ins" << std::endl;
+    store.report(std::cout);
+}
+
+// build time of the sphere field at a few sizes, then the field animated: rebuilding the BVH every frame,
+// only refitting it, and refitting with a rebuild once Bvh::needs_rebuild() says so; trace times are for
+// one 256x192 batch of primary rays against each of the three trees
+void run_bvh_bench(const int frames)
+{
+    std::cout << "primitives  build ms  Mprims/s  SAH cost" << std::endl;
+    for (size_t count : {10000, 100000, 1000000})
+    {
+        Scene scene;
+        scene.spheres = build_sphere_field(count);
+        double best = std::numeric_limits<double>::max();
+        for (int k = 0; k < 3; k++)
+        {
+            render_clock::time_point start = render_clock::now();
+            scene.build();
+            best = std::min(best, elapsed_ms(start, render_clock::now()));
+        }
+        std::cout << std::setw(10) << count << std::setw(10) << best << std::setw(10) << count / (best * 1e3) << std::setw(10) << scene.bvh.sah_cost() << std::endl;
+    }
+
+    const size_t count = 100000;
+    Scene scene;
+    scene.spheres = build_sphere_field(count);
+    for (int m = 0; m < 4; m++)
+        scene.add_material(Material());
+    scene.build();
+    std::vector<vec3> velocity(count);
+    for (size_t i = 0; i < count; i++)
+        velocity[i] = vec3{sample_offset(i, 1, 0) - .5f, sample_offset(i, 1, 1) - .5f, sample_offset(i, 1, 2) - .5f};
+    Bvh rebuilt, refitted = scene.bvh, adaptive = scene.bvh;
+
+    auto trace = [&scene](Bvh &bvh, size_t &hits) {
+        std::swap(scene.bvh, bvh);
+        render_clock::time_point start = render_clock::now();
+        const int width = 256, height = 192;
+        size_t found = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : found)
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+            {
+                vec3 point, N;
+                Material material;
+                vec3 dir = vec3{(i + 0.5f) - width / 2.f, -(j + 0.5f) + height / 2.f, float(-height / (2. * tan(M_PI / 6.)))}.normalize();
+                found += scene_intersect(vec3{0, 0, 0}, dir, scene, point, N, material);
+            }
+        hits = found;
+        std::swap(scene.bvh, bvh);
+        return elapsed_ms(start, render_clock::now());
+    };
+
+    std::cout << "frame  rebuild ms  trace ms  refit ms  SAH ratio  trace ms  adaptive ms  SAH ratio  trace ms" << std::endl;
+    for (int f = 1; f <= frames; f++)
+    {
+        for (size_t i = 0; i < count; i++)
+            scene.spheres[i].center = scene.spheres[i].center + velocity[i];
+        std::vector<Aabb> bounds = scene.prim_bounds();
+
+        render_clock::time_point start = render_clock::now();
+        rebuilt.build(bounds);
+        double rebuild_ms = elapsed_ms(start, render_clock::now());
+        start = render_clock::now();
+        refitted.refit(bounds);
+        double refit_ms = elapsed_ms(start, render_clock::now());
+        start = render_clock::now();
+        adaptive.refit(bounds);
+        bool rebuilt_adaptive = adaptive.needs_rebuild();
+        if (rebuilt_adaptive)
+            adaptive.build(bounds);
+        double adaptive_ms = elapsed_ms(start, render_clock::now());
+
+        size_t hits[3];
+        double rebuilt_trace = trace(rebuilt, hits[0]), refitted_trace = trace(refitted, hits[1]), adaptive_trace = trace(adaptive, hits[2]);
+        std::cout << std::setw(5) << f << std::setw(12) << rebuild_ms << std::setw(10) << rebuilt_trace << std::setw(10) << refit_ms
+                  << std::setw(11) << refitted.sah_cost() / rebuilt.sah_cost() << std::setw(10) << refitted_trace << std::setw(12) << adaptive_ms
+                  << (rebuilt_adaptive ? "*" : " ") << std::setw(10) << adaptive.sah_cost() / rebuilt.sah_cost() << std::setw(10) << adaptive_trace;
+        if (hits[1] != hits[0] || hits[2] != hits[0])
+            std::cout << "  hits differ: " << hits[0] << " " << hits[1] << " " << hits[2];
+        std::cout << std::endl;
+    }
+    std::cout << "* rebuilt" << std::endl;
+}
+
+// the scene of this chapter: four spheres above a checkerboard
+void build_chessboard_scene(Scene &scene)
+{
+    uint32_t purpel_material = scene.add_material(Material(1.0, vec4{0.4, 0.3, 0.1, 0.0}, vec3{0.58, 0.44, 0.86}, 50));
+    uint32_t red_material = scene.add_material(Material(1.0, vec4{0.3, 0.1, 0.0, 0.0}, vec3{1.0, 0.42, 0.42}, 10));
+    uint32_t mirror = scene.add_material(Material(1.0, vec4{0.0, 10.0, 0.8, 0.0}, vec3{1.0, 1.0, 1.0}, 1425));
+    uint32_t glass = scene.add_material(Material(1.5, vec4{0.0, 0.5, 0.1, 0.8}, vec3{0.6, 0.7, 0.8}, 125));
+
+    scene.spheres.push_back(Sphere(vec3{-3, 0, -16}, 2, purpel_material));
+    scene.spheres.push_back(Sphere(vec3{-1.0, -1.5, -12}, 2, glass));
+    scene.spheres.push_back(Sphere(vec3{1.5, -0.5, -18}, 3, red_material));
+    scene.spheres.push_back(Sphere(vec3{7, 5, -18}, 4, mirror));
+
+    Material board;
+    board.texture = scene.add_texture(new CheckerTexture(scene.add_texture(new ConstantTexture(vec3{.3, .3, .3})), scene.add_texture(new ConstantTexture(vec3{.3, .2, .1})), .5));
+    scene.planes.push_back(Plane(vec3{0, 1, 0}, -4, vec3{1, 0, 0}, vec3{0, 0, 1}, scene.add_material(board)).clip(vec3{-10, -4, -30}, vec3{10, -4, -10}));
+
+    scene.lights.push_back(Light(vec3{-20, 20, 20}, 1.5));
+    scene.lights.push_back(Light(vec3{30, 50, -25}, 1.8));
+    scene.lights.push_back(Light(vec3{30, 20, 30}, 1.7));
+}
+
+// the chessboard scene on an infinite gradient ground, with a couple of boxes
+void build_boxes_scene(Scene &scene)
+{
+    build_chessboard_scene(scene);
+    uint32_t ivory = scene.add_material(Material(1.0, vec4{0.6, 0.3, 0.1, 0.0}, vec3{0.4, 0.4, 0.3}, 50));
+    Material tiles(1.0, vec4{0.9, 0.1, 0.0, 0.0}, vec3{0, 0, 0}, 10);
+    tiles.texture = scene.add_texture(new CheckerTexture(scene.add_texture(new ConstantTexture(vec3{0.8, 0.8, 0.8})), scene.add_texture(new ConstantTexture(vec3{0.2, 0.3, 0.6})), 2));
+    scene.boxes.push_back(Box(vec3{-8, -4, -24}, vec3{-5, -1, -21}, scene.add_material(tiles)));
+    scene.boxes.push_back(Box(vec3{3, -4, -13}, vec3{5, -3, -11}, ivory));
+
+    Material ground;
+    ground.texture = scene.add_texture(new GradientTexture(scene.add_texture(new ConstantTexture(vec3{0.1, 0.1, 0.1})), scene.add_texture(new ConstantTexture(vec3{0.5, 0.6, 0.5})), vec3{0, 0, -1}, 10, 60));
+    scene.planes.push_back(Plane(vec3{0, 1, 0}, -4.01, vec3{1, 0, 0}, vec3{0, 0, 1}, scene.add_material(ground)));
+}
+
+// a forest of instanced trees: memory follows the single tree prototype, not the 2500 placed copies
+void build_forest_scene(Scene &scene)
+{
+    uint32_t bark = scene.add_material(Material(1.0, vec4{0.9, 0.1, 0.0, 0.0}, vec3{0.35, 0.22, 0.1}, 10));
+    uint32_t leaves = scene.add_material(Material(1.0, vec4{0.8, 0.2, 0.0, 0.0}, vec3{0.2, 0.55, 0.2}, 30));
+    Prototype tree;
+    for (int i = 0; i < 8; i++)
+        tree.spheres.push_back(Sphere(vec3{0, i * 0.4f, 0}, 0.3, bark));
+    for (int i = 0; i < 64; i++)
+    { // canopy: spheres on a golden-angle spiral around the top of the trunk
+        float y = 1 - 2 * (i + 0.5f) / 64, r = sqrtf(1 - y * y), phi = i * 2.39996f;
+        tree.spheres.push_back(Sphere(vec3{r * cosf(phi), 4 + y, r * sinf(phi)}, 0.45, leaves));
+    }
+    scene.prototypes.push_back(tree);
+
+    for (int j = 0; j < 50; j++)
+        for (int i = 0; i < 50; i++)
+        {
+            uint32_t cell = i + j * 50;
+            vec3 position{-50 + 2 * i + 1.5f * sample_offset(cell, 0, 0), -4, -10 - 2 * j - 1.5f * sample_offset(cell, 0, 1)};
+            scene.instances.push_back(Instance(0, Affine::place(position, 6.28318f * sample_offset(cell, 0, 2), 0.6f + 0.6f * sample_offset(cell, 0, 3))));
+        }
+
+    Material ground;
+    ground.texture = scene.add_texture(new CheckerTexture(scene.add_texture(new ConstantTexture(vec3{.25, .3, .15})), scene.add_texture(new ConstantTexture(vec3{.3, .25, .1})), .5));
+    scene.planes.push_back(Plane(vec3{0, 1, 0}, -4, vec3{1, 0, 0}, vec3{0, 0, 1}, scene.add_material(ground)));
+
+    scene.lights.push_back(Light(vec3{-20, 20, 20}, 1.5));
+    scene.lights.push_back(Light(vec3{30, 50, -25}, 1.8));
+    scene.lights.push_back(Light(vec3{30, 20, 30}, 1.7));
+}
+
+size_t bvh_bytes(const Bvh &bvh)
+{
+    return bvh.nodes.size() * sizeof(BvhNode) + bvh.prims.size() * sizeof(uint32_t);
+}
+
+// scene memory by part, against the same scene with every instance expanded into plain spheres
+void print_memory_report(const Scene &scene)
+{
+    size_t placed_spheres = scene.spheres.size();
+    size_t prototype_bytes = 0;
+    for (const Prototype &prototype : scene.prototypes)
+        prototype_bytes += prototype.spheres.size() * sizeof(Sphere) + bvh_bytes(prototype.bvh);
+    std::vector<Aabb> flat_bounds;
+    for (const Sphere &sphere : scene.spheres)
+    {
+        vec3 lo, hi;
+        sphere.bounds(lo, hi);
+        flat_bounds.push_back(Aabb(lo, hi));
+    }
+    for (const Instance &instance : scene.instances)
+    {
+        const Prototype &prototype = scene.prototypes[instance.prototype];
+        placed_spheres += prototype.spheres.size();
+        for (const Sphere &sphere : prototype.spheres)
+        {
+            vec3 lo, hi;
+            sphere.bounds(lo, hi);
+            flat_bounds.push_back(instance.bounds(Aabb(lo, hi)));
+        }
+    }
+    Bvh flat;
+    flat.build(flat_bounds);
+
+    size_t primitive_bytes = scene.spheres.size() * sizeof(Sphere) + scene.planes.size() * sizeof(Plane) + scene.boxes.size() * sizeof(Box) + scene.materials.size() * sizeof(Material);
+    size_t instance_bytes = scene.instances.size() * sizeof(Instance);
+    size_t top_bytes = bvh_bytes(scene.bvh) + scene.prims.size() * sizeof(PrimRef);
+    size_t total = primitive_bytes + prototype_bytes + instance_bytes + top_bytes;
+    size_t flat_total = primitive_bytes + (placed_spheres - scene.spheres.size()) * sizeof(Sphere) + bvh_bytes(flat) + flat_bounds.size() * sizeof(PrimRef);
+    std::cout << "scene memory: " << scene.prototypes.size() << " prototypes, " << scene.instances.size() << " instances, " << placed_spheres << " placed spheres" << std::endl
+              << "  primitives + materials " << primitive_bytes / 1024. << " KB" << std::endl
+              << "  prototypes + BLAS      " << prototype_bytes / 1024. << " KB" << std::endl
+              << "  instances              " << instance_bytes / 1024. << " KB" << std::endl
+              << "  TLAS                   " << top_bytes / 1024. << " KB" << std::endl
+              << "  total " << total / 1024. << " KB, flattened " << flat_total / 1024. << " KB" << std::endl;
+}
+
+// every curve over a synthetic HDR frame much larger than the caches, best of five passes each, against a
+// memcpy of the framebuffer; a pass reads 12 bytes and writes 3 per pixel
+void run_tonemap_bench()
+{
+    const size_t pixels = size_t(4096) * 2048;
+    std::vector<vec3> framebuffer(pixels), copy(pixels);
+    for (size_t i = 0; i < pixels; i++) // up to 4x white, the range the curves compress
+        framebuffer[i] = vec3{4 * sample_offset(i, 0, 0), 4 * sample_offset(i, 0, 1), 4 * sample_offset(i, 0, 2)};
+    std::vector<unsigned char> bytes;
+    auto best_of = [](const auto &pass) {
+        pass(); // faults the pages in
+        double best = std::numeric_limits<double>::max();
+        for (int k = 0; k < 5; k++)
+        {
+            render_clock::time_point start = render_clock::now();
+            pass();
+            best = std::min(best, elapsed_ms(start, render_clock::now()));
+        }
+        return best;
+    };
+    double copy_ms = best_of([&]() { std::copy(framebuffer.begin(), framebuffer.end(), copy.begin()); });
+    std::cout << "4096x2048 framebuffer, memcpy: " << copy_ms << "ms, " << 2 * pixels * sizeof(vec3) / (copy_ms * 1e6) << " GB/s" << std::endl;
+    std::cout << "curve       dither        ms      GB/s  of memcpy" << std::endl;
+    for (int c = 0; c < TONE_CURVES; c++)
+        for (bool dither : {false, true})
+        {
+            if (c == TONE_LEGACY && dither)
+                continue; // the legacy output is not quantized through the table
+            ToneSettings tone;
+            tone.curve = ToneCurve(c);
+            tone.dither = dither;
+            double ms = best_of([&]() { tonemap(framebuffer, bytes, tone); });
+            std::cout << std::left << std::setw(12) << TONE_CURVE_NAMES[c] << std::setw(6) << (dither ? "yes" : "no") << std::right << std::setw(10) << ms
+                      << std::setw(10) << pixels * (sizeof(vec3) + 3) / (ms * 1e6) << std::setw(10) << 100 * copy_ms / ms << "%" << std::endl;
+        }
+}
+
+int main(int argc, char **argv)
+{
+    std::string mode, scene_name = "chessboard", floor_texture, trace_file;
+    size_t texture_cache_mb = 64, field_spheres = 1000000, chunk_cache_mb = 8;
+    int spp = 1, frames = 24;
+    uint32_t aov_mask = 0;
+    PathSettings path;
+    bool ray_stats = false, memory_report = false, denoised = false, numa = false, replicate = false;
+    ToneSettings tone;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--scene" && i + 1 < argc)
+            scene_name = argv[++i];
+        else if (arg == "--floor-texture" && i + 1 < argc)
+            floor_texture = argv[++i];
+        else if (arg == "--texture-cache-mb" && i + 1 < argc)
+            texture_cache_mb = std::stoul(argv[++i]);
+        else if (arg == "--field-spheres" && i + 1 < argc)
+            field_spheres = std::stoul(argv[++i]);
+        else if (arg == "--chunk-cache-mb" && i + 1 < argc)
+            chunk_cache_mb = std::stoul(argv[++i]);
+        else if (arg == "--spp" && i + 1 < argc && std::stoi(argv[i + 1]) > 0 && std::stoi(argv[i + 1]) <= MAX_JOB_SPP) // the server's bound
+            spp = std::stoi(argv[++i]);
+        else if (arg == "--denoise")
+            denoised = true;
+        else if (arg == "--trace" && i + 1 < argc && PROFILE_ENABLED)
+            trace_file = argv[++i];
+        else if (arg == "--frames" && i + 1 < argc)
+            frames = std::stoi(argv[++i]);
+        else if (arg == "--aov" && i + 1 < argc && parse_aov_mask(argv[i + 1], aov_mask))
+            i++;
+        else if (arg == "--max-depth" && i + 1 < argc)
+            path.max_depth = std::stoul(argv[++i]);
+        else if (arg == "--min-contribution" && i + 1 < argc)
+            path.min_contribution = std::stof(argv[++i]);
+        else if (arg == "--roulette")
+            path.roulette = true;
+        else if (arg == "--ray-stats")
+            ray_stats = true;
+        else if (arg == "--memory")
+            memory_report = true;
+        else if (arg == "--numa")
+            numa = true;
+        else if (arg == "--tonemap" && i + 1 < argc && parse_tone_curve(argv[i + 1], tone.curve))
+            i++;
+        else if (arg == "--exposure" && i + 1 < argc && parse_exposure(argv[i + 1], tone.exposure))
+            i++;
+        else if (arg == "--dither")
+            tone.dither = true;
+        else if (arg == "--replicate-scene")
+            numa = replicate = true;
+        else if (arg == "--server" || arg == "--incremental" || arg == "--path-report" || arg == "--out-of-core" || arg == "--bench-denoise" || arg == "--animate" ||
+                 arg == "--bench-numa" || arg == "--bench-bvh" || arg == "--bench-tonemap")
+            mode = arg;
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--server | --incremental | --path-report | --out-of-core | --bench-denoise | --animate | --bench-numa | --bench-bvh | --bench-tonemap]"
+                      << " [--scene chessboard|boxes|forest] [--memory] [--frames N] [--numa] [--replicate-scene]"
+                      << " [--spp N] [--denoise] [--aov color,depth,normal,albedo,material,object,rays|all]"
+                      << " [--max-depth N] [--min-contribution W] [--roulette] [--ray-stats] [--floor-texture image.ppm|image.tex] [--texture-cache-mb N]"
+                      << " [--field-spheres N] [--chunk-cache-mb N] [--tonemap legacy|clamp|reinhard|filmic|aces] [--exposure EV] [--dither, not with legacy]" << (PROFILE_ENABLED ? " [--trace trace.json]" : "") << std::endl;
+            return 1;
+        }
+    }
+    if (tone.dither && tone.curve == TONE_LEGACY)
+    { // the legacy curve keeps the original output byte for byte and has no dithering
+        std::cerr << "--dither needs one of the --tonemap curves other than legacy" << std::endl;
+        return 1;
+    }
+
+    TiledImage floor_image; // texture storage outlives the scene that references it
+    TextureCache texture_cache(texture_cache_mb << 20);
+    Scene scene;
+    {
+        PROFILE_SCOPE("scene setup");
+        if (scene_name == "boxes")
+            build_boxes_scene(scene);
+        else if (scene_name == "forest")
+            build_forest_scene(scene);
+        else
+            build_chessboard_scene(scene);
+        if (!floor_texture.empty())
+        {
+            std::string tiled = floor_texture;
+            if (tiled.size() > 4 && tiled.compare(tiled.size() - 4, 4, ".ppm") == 0)
+            { // convert once next to the source image; later runs map the tiled file directly
+                tiled += ".tex";
+                if (!std::ifstream(tiled) && !write_tiled_image(floor_texture, tiled))
+                {
+                    std::cerr << "cannot convert " << floor_texture << std::endl;
+                    return 1;
+                }
+            }
+            if (!floor_image.open(tiled))
+            {
+                std::cerr << "cannot read " << tiled << std::endl;
+                return 1;
+            }
+            scene.materials[scene.planes[0].material].texture = scene.add_texture(new ImageTexture(&floor_image, &texture_cache));
+            scene.planes[0].u_axis = vec3{0.05, 0, 0}; // one copy of the image over the 20x20 board
+            scene.planes[0].v_axis = vec3{0, 0, 0.05};
+        }
+        scene.build();
+    }
+    if (memory_report)
+        print_memory_report(scene);
+
+    if (mode == "--server")
+        run_server(scene, path);
+    else if (mode == "--incremental")
+        run_incremental(scene, path);
+    else if (mode == "--path-report")
+        run_path_report(scene, path);
+    else if (mode == "--out-of-core")
+        run_out_of_core(field_spheres, chunk_cache_mb);
+    else if (mode == "--bench-denoise")
+        run_denoise_bench(scene, path);
+    else if (mode == "--animate")
+        run_animation(scene, path, frames);
+    else if (mode == "--bench-numa")
+        run_numa_bench(scene, path, frames);
+    else if (mode == "--bench-bvh")
+        run_bvh_bench(frames);
+    else if (mode == "--bench-tonemap")
+        run_tonemap_bench();
+    else
+    {
+        const int width = 1024;
+        const int height = 768;
+        std::vector<vec3> framebuffer;
+        RayCounts counts;
+        GuideBuffers guides;
+        AovWriter aovs;
+        if (aov_mask && !aovs.open("./outChessboardImage.aov", width, height, TILE_SIZE, aov_mask))
+        {
+            std::cerr << "cannot write ./outChessboardImage.aov" << std::endl;
+            return 1;
+        }
+        bool rendered = false;
+        if (numa && !denoised && !aov_mask)
+        { // pinned workers and node-local tiles; guides and AOVs are only produced by render()
+            std::vector<WorkerPlacement> workers = place_workers(numa_topology());
+            std::vector<std::unique_ptr<Scene>> replicas;
+            std::vector<const Scene *> scenes{&scene};
+            if (replicate)
+            {
+                replicas = replicate_scene(scene, workers);
+                scenes.clear();
+                for (const std::unique_ptr<Scene> &replica : replicas)
+                    scenes.push_back(replica.get());
+            }
+            NodeFramebuffer tiles;
+            std::vector<RayCounts> node_counts;
+            rendered = render_numa(framebuffer, width, height, spp, Camera(), scenes, path, workers, tiles, true, &node_counts);
+            if (!rendered)
+                std::cerr << "cannot map the node-local framebuffer, rendering without --numa" << std::endl;
+            for (const RayCounts &c : node_counts)
+                counts.add(c);
+        }
+        if (!rendered)
+            render(framebuffer, width, height, spp, Camera(), scene, path, &counts, nullptr, nullptr, denoised ? &guides : nullptr, aov_mask ? &aovs : nullptr);
+        if (aov_mask)
+            std::cout << "aov: at most " << aovs.peak_bands() << " of " << (height + TILE_SIZE - 1) / TILE_SIZE << " tile rows ("
+                      << aovs.peak_bands() * aovs.band_bytes() / 1024. << " KB) buffered" << std::endl;
+        if (denoised)
+            denoise(std::vector<vec3>(framebuffer), framebuffer, guides);
+        if (!save_ppm("./outChessboardImage.ppm", framebuffer, width, height, tone))
+        {
+            std::cerr << "cannot write ./outChessboardImage.ppm" << std::endl;
+            return 1;
+        }
+        if (ray_stats)
+            print_ray_counts(counts);
+        if (!floor_texture.empty())
+            texture_cache.report(std::cout);
+    }
+    if (!trace_file.empty())
+    {
+        size_t overwritten;
+        size_t events = write_chrome_trace(trace_file, overwritten);
+        std::cout << "trace: " << events << " events written to " << trace_file;
+        if (overwritten)
+            std::cout << ", " << overwritten << " overwritten in full rings";
+        std::cout << std::endl;
+    }
     return 0;
 }
@@ -0,0 +1,220 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "profile.h"
+
+// Post-processing from the linear float framebuffer to 8-bit output.
+//
+// Exposure scales the colour by 2^stops, a tone curve maps it into [0, 1] and a lookup table encodes the
+// result to sRGB, optionally dithered. The legacy curve is the original output and stays the default:
+// each pixel is divided by its largest component when that is above 1, then clamped and written without
+// sRGB encoding, so images are byte-identical to before. The framebuffer is cut into chunks spread over the
+// OpenMP threads; per chunk the curve runs as a SIMD loop into a small buffer of table indices (and dither
+// offsets), and the lookups follow while the chunk is still in cache.
+
+enum ToneCurve
+{
+    TONE_LEGACY,
+    TONE_CLAMP,
+    TONE_REINHARD,
+    TONE_FILMIC,
+    TONE_ACES,
+    TONE_CURVES
+};
+
+const char *const TONE_CURVE_NAMES[TONE_CURVES] = {"legacy", "clamp", "reinhard", "filmic", "aces"};
+
+struct ToneSettings
+{
+    ToneCurve curve = TONE_LEGACY;
+    float exposure = 0;  // stops
+    bool dither = false; // uniform noise of one code value before truncation instead of rounding
+};
+
+bool parse_tone_curve(const std::string &name, ToneCurve &curve)
+{
+    for (int c = 0; c < TONE_CURVES; c++)
+        if (name == TONE_CURVE_NAMES[c])
+        {
+            curve = ToneCurve(c);
+            return true;
+        }
+    return false;
+}
+
+// false for exposures whose scale 2^stops is not a finite float
+bool parse_exposure(const std::string &text, float &exposure)
+{
+    exposure = std::stof(text);
+    return std::isfinite(std::exp2(exposure));
+}
+
+const int SRGB_TABLE_SIZE = 4096;
+const size_t TONE_CHUNK = 1024; // pixels per step of the SIMD loop and the lookups
+
+// 8-bit sRGB code values of the linear values i / (SRGB_TABLE_SIZE - 1), rounded, and as floats so that the
+// dither offset can be added before truncation. 4096 entries keep neighbouring entries within one code value
+// of each other down to the darkest steps.
+struct SrgbTable
+{
+    float code[SRGB_TABLE_SIZE];
+    unsigned char rounded[SRGB_TABLE_SIZE];
+
+    SrgbTable()
+    {
+        for (int i = 0; i < SRGB_TABLE_SIZE; i++)
+        {
+            double x = double(i) / (SRGB_TABLE_SIZE - 1);
+            code[i] = float(255 * (x <= 0.0031308 ? 12.92 * x : 1.055 * std::pow(x, 1 / 2.4) - 0.055));
+            rounded[i] = (unsigned char)(code[i] + .5f);
+        }
+    }
+};
+
+const SrgbTable &srgb_table()
+{
+    static const SrgbTable table;
+    return table;
+}
+
+// Clamps done on the bit patterns, as in fast_exp (denoise.h): the vectorizer will not turn float compares
+// into selects, integer ones it will. Negative floats are negative integers and non-negative ones order like
+// their values, so these are exact for every float but NaN.
+inline int32_t float_bits(const float x)
+{
+    int32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    return i;
+}
+
+inline float bits_float(const int32_t i)
+{
+    float x;
+    std::memcpy(&x, &i, sizeof(x));
+    return x;
+}
+
+inline float at_least_zero(const float x) { return bits_float(std::max(float_bits(x), 0)); }
+inline float clamp01(const float x) { return bits_float(std::min(std::max(float_bits(x), 0), 0x3F800000)); } // 1.f
+inline float max_nonnegative(const float a, const float b) { return bits_float(std::max(float_bits(a), float_bits(b))); }
+
+// the curves on an exposed linear value; all return values in [0, 1]
+template <ToneCurve curve>
+inline float tone_curve(float x)
+{
+    x = at_least_zero(x);
+    switch (curve)
+    {
+    case TONE_REINHARD:
+        return clamp01(x / (1 + x)); // NaN for inf, and every result indexes the table
+    case TONE_FILMIC:
+    { // Hable's filmic curve with its usual white point of 11.2 and exposure bias of 2
+        const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+        const float white = 11.2f, white_scale = 1 / (((white * (A * white + C * B) + D * E) / (white * (A * white + B) + D * F)) - E / F);
+        x *= 2;
+        return clamp01((((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F) * white_scale);
+    }
+    case TONE_ACES: // Narkowicz's fit of the ACES reference rendering transform
+        return clamp01((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f));
+    default:
+        return clamp01(x);
+    }
+}
+
+// offset in [0, 1) for byte i of the output, a hash so that it does not depend on the chunking
+inline float dither_offset(uint32_t i)
+{
+    i *= 0x9E3779B1u;
+    i ^= i >> 16;
+    i *= 0x7FEB352Du;
+    i ^= i >> 15;
+    return (i >> 8) * (1.f / 16777216.f);
+}
+
+template <ToneCurve curve>
+void tonemap_chunk(const vec3 *in, unsigned char *out, const size_t first, const size_t count, const float scale, const bool dither)
+{
+    int index[3 * TONE_CHUNK];
+    float offset[3 * TONE_CHUNK];
+    const SrgbTable &table = srgb_table();
+#pragma omp simd
+    for (size_t i = 0; i < count; i++)
+    {
+        index[3 * i] = int(tone_curve<curve>(in[i].x * scale) * (SRGB_TABLE_SIZE - 1) + .5f);
+        index[3 * i + 1] = int(tone_curve<curve>(in[i].y * scale) * (SRGB_TABLE_SIZE - 1) + .5f);
+        index[3 * i + 2] = int(tone_curve<curve>(in[i].z * scale) * (SRGB_TABLE_SIZE - 1) + .5f);
+    }
+    if (!dither)
+    {
+        for (size_t i = 0; i < 3 * count; i++)
+            out[i] = table.rounded[index[i]];
+        return;
+    }
+#pragma omp simd
+    for (size_t i = 0; i < 3 * count; i++)
+        offset[i] = dither_offset(uint32_t(3 * first + i));
+    for (size_t i = 0; i < 3 * count; i++)
+        out[i] = (unsigned char)(table.code[index[i]] + offset[i]);
+}
+
+// the original output: per-pixel normalization by the largest component, clamped, linear. The largest
+// component is taken over the components clamped at zero, which changes nothing where it is above 1.
+void tonemap_legacy_chunk(const vec3 *in, unsigned char *out, const size_t count, const float scale)
+{
+#pragma omp simd
+    for (size_t i = 0; i < count; i++)
+    {
+        const float r = in[i].x * scale, g = in[i].y * scale, b = in[i].z * scale;
+        const float max = max_nonnegative(max_nonnegative(at_least_zero(r), at_least_zero(g)), max_nonnegative(at_least_zero(b), 1.f));
+        const float inv = 1. / max; // 1 unless the pixel is brighter than white
+        out[3 * i] = (unsigned char)(255 * clamp01(r * inv));
+        out[3 * i + 1] = (unsigned char)(255 * clamp01(g * inv));
+        out[3 * i + 2] = (unsigned char)(255 * clamp01(b * inv));
+    }
+}
+
+// 8-bit RGB triples of the framebuffer, ready for a PPM; false, leaving bytes alone, if the exposure scale
+// is not a finite float
+bool tonemap(const std::vector<vec3> &framebuffer, std::vector<unsigned char> &bytes, const ToneSettings &settings = ToneSettings())
+{
+    PROFILE_SCOPE("tone map");
+    const size_t pixels = framebuffer.size();
+    const float scale = std::exp2(settings.exposure);
+    if (!std::isfinite(scale))
+        return false;
+    bytes.resize(3 * pixels);
+    srgb_table(); // built once, before the threads need it
+#pragma omp parallel for schedule(static)
+    for (size_t first = 0; first < pixels; first += TONE_CHUNK)
+    {
+        const size_t count = std::min(TONE_CHUNK, pixels - first);
+        const vec3 *in = &framebuffer[first];
+        unsigned char *out = &bytes[3 * first];
+        switch (settings.curve)
+        {
+        case TONE_LEGACY:
+            tonemap_legacy_chunk(in, out, count, scale);
+            break;
+        case TONE_CLAMP:
+            tonemap_chunk<TONE_CLAMP>(in, out, first, count, scale, settings.dither);
+            break;
+        case TONE_REINHARD:
+            tonemap_chunk<TONE_REINHARD>(in, out, first, count, scale, settings.dither);
+            break;
+        case TONE_FILMIC:
+            tonemap_chunk<TONE_FILMIC>(in, out, first, count, scale, settings.dither);
+            break;
+        default:
+            tonemap_chunk<TONE_ACES>(in, out, first, count, scale, settings.dither);
+        }
+    }
+    return true;
+}
+
+#endif //__TONEMAP_H__
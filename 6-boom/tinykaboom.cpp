@@ -1,13 +1,17 @@
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <limits>
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <vector>
 #include "geometry.h"
+#include "volume.h"
 
 const float sphere_radius   = 1.5;
+const float noise_amplitude = 0.6; // of the fireball surface, relative to its radius
 
 float signed_distance(vec3 &p) {
     return p.norm() - sphere_radius;
@@ -23,35 +27,178 @@ bool sphere_trace(const vec3 &orig, const vec3 &dir, vec3 &pos) {
     return false;
 }
 
-int main() {
-    const int   width    = 1024;
-    const int   height   = 768;
-    const float fov      = M_PI/3.;
-    std::vector<vec3> framebuffer(width*height);
+template <typename T> inline T lerp(const T &v0, const T &v1, float t) {
+    return v0 + (v1-v0)*std::max(0.f, std::min(1.f, t));
+}
+
+float hash(const float n) {
+    float x = std::sin(n)*43758.5453f;
+    return x-std::floor(x);
+}
+
+float noise(const vec3 &x) {
+    vec3 p{std::floor(x.x), std::floor(x.y), std::floor(x.z)};
+    vec3 f{x.x-p.x, x.y-p.y, x.z-p.z};
+    f = vec3{f.x*f.x*(3.f-2.f*f.x), f.y*f.y*(3.f-2.f*f.y), f.z*f.z*(3.f-2.f*f.z)}; // smoothstep
+    float n = p*vec3{1.f, 57.f, 113.f};
+    return lerp(lerp(
+                     lerp(hash(n +  0.f), hash(n +  1.f), f.x),
+                     lerp(hash(n + 57.f), hash(n + 58.f), f.x), f.y),
+                lerp(
+                    lerp(hash(n + 113.f), hash(n + 114.f), f.x),
+                    lerp(hash(n + 170.f), hash(n + 171.f), f.x), f.y), f.z);
+}
+
+vec3 rotate(const vec3 &v) {
+    return vec3{vec3{0.00,  0.80,  0.60}*v, vec3{-0.80,  0.36, -0.48}*v, vec3{-0.60, -0.48,  0.64}*v};
+}
+
+float fractal_brownian_motion(const vec3 &x) {
+    vec3 p = rotate(x);
+    float f = 0;
+    f += 0.5000*noise(p); p = p*2.32;
+    f += 0.2500*noise(p); p = p*3.03;
+    f += 0.1250*noise(p); p = p*2.61;
+    f += 0.0625*noise(p);
+    return f/0.9375;
+}
+
+// a ball of radius r with a noisy surface, dense in the core and thinning out over its outer half
+float fireball_density(const vec3 &p, const float r) {
+    vec3 q = p;
+    float surface = r*(1 + noise_amplitude*(fractal_brownian_motion(p*(3.4f/r)) - .5f));
+    return std::max(0.f, std::min(1.f, (surface - q.norm())/(.5f*r)));
+}
 
+vec3 camera_ray(const size_t i, const size_t j, const int width, const int height, const float fov) {
+    float dir_x =  (i + 0.5) -  width/2.;
+    float dir_y = -(j + 0.5) + height/2.;    // this flips the image at the same time
+    float dir_z = -height/(2.*tan(fov/2.));
+    return vec3{dir_x, dir_y, dir_z}.normalize();
+}
+
+// the first chapter's binary hit/miss image of the sphere SDF
+void render_sdf(std::vector<vec3> &framebuffer, const int width, const int height, const float fov) {
 #pragma omp parallel for
-    for (size_t j = 0; j<height; j++) { // actual rendering loop
-        for (size_t i = 0; i<width; i++) {
-            float dir_x =  (i + 0.5) -  width/2.;
-            float dir_y = -(j + 0.5) + height/2.;    // this flips the image at the same time
-            float dir_z = -height/(2.*tan(fov/2.));
+    for (int j = 0; j<height; j++) { // actual rendering loop
+        for (int i = 0; i<width; i++) {
             vec3 hit;
-            if (sphere_trace(vec3{0, 0, 3}, vec3{dir_x, dir_y, dir_z}.normalize(), hit)) { // the camera is placed to (0,0,3) and it looks along the -z axis
+            if (sphere_trace(vec3{0, 0, 3}, camera_ray(i, j, width, height, fov), hit)) { // the camera is placed to (0,0,3) and it looks along the -z axis
                 framebuffer[i+j*width] = vec3{1, 1, 1};
             } else {
                 framebuffer[i+j*width] = vec3{0.2, 0.7, 0.8}; // background color
             }
         }
     }
+}
+
+void render_volume(std::vector<vec3> &framebuffer, const int width, const int height, const float fov, const BrickMap &map, const MarchSettings &settings, MarchStats &stats) {
+    uint64_t samples = 0, bricks = 0, early_exits = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:samples, bricks, early_exits)
+    for (int j = 0; j<height; j++) {
+        MarchStats row;
+        for (int i = 0; i<width; i++)
+            framebuffer[i+j*width] = march(map, vec3{0, 0, 3}, camera_ray(i, j, width, height, fov), vec3{0.2, 0.7, 0.8}, settings, row);
+        samples += row.samples;
+        bricks += row.bricks;
+        early_exits += row.early_exits;
+    }
+    stats.samples += samples;
+    stats.bricks += bricks;
+    stats.early_exits += early_exits;
+}
 
-    std::ofstream ofs("./out.ppm", std::ios::binary); // save the framebuffer to file
+void save_ppm(const std::string &filename, const std::vector<vec3> &framebuffer, const int width, const int height) {
+    std::ofstream ofs(filename, std::ios::binary); // save the framebuffer to file
     ofs << "P6\n" << width << " " << height << "\n255\n";
-    for (size_t i = 0; i < height*width; ++i) {
+    for (size_t i = 0; i < size_t(height*width); ++i) {
         for (size_t j = 0; j<3; j++) {
             ofs << (char)(std::max(0, std::min(255, static_cast<int>(255*framebuffer[i][j]))));
         }
     }
     ofs.close();
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point from) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - from).count();
+}
+
+// bakes the fireball into a brick map over a fixed box around it; bricks entirely outside the largest
+// surface the noise can produce are known to be empty without sampling them
+void build_fireball(BrickMap &map, const float radius, const int bricks) {
+    const float extent = 2.5;
+    const float outer = radius*(1 + noise_amplitude*.5f);
+    map.build(vec3{-extent, -extent, -extent}, vec3{extent, extent, extent}, bricks,
+              [radius](const vec3 &p) { return fireball_density(p, radius); },
+              [outer](const vec3 &lo, const vec3 &hi) {
+                  vec3 nearest{std::max(lo.x, std::min(0.f, hi.x)), std::max(lo.y, std::min(0.f, hi.y)), std::max(lo.z, std::min(0.f, hi.z))};
+                  return nearest*nearest < outer*outer;
+              });
+}
+
+// frame time against the occupied share of the box, with and without empty-space skipping
+void run_bench(const int bricks) {
+    const int width = 512, height = 384;
+    const float fov = M_PI/3.;
+    std::vector<vec3> framebuffer(width*height);
+    std::cout << "radius  occupied  bake ms  skip ms  samples/ray  march-all ms  samples/ray" << std::endl;
+    for (float radius : {0.375f, 0.75f, 1.125f, 1.5f}) {
+        BrickMap map;
+        auto start = std::chrono::steady_clock::now();
+        build_fireball(map, radius, bricks);
+        double bake = elapsed_ms(start);
+        MarchSettings skip, all;
+        all.skip_empty = false;
+        MarchStats skip_stats, all_stats;
+        start = std::chrono::steady_clock::now();
+        render_volume(framebuffer, width, height, fov, map, skip, skip_stats);
+        double skip_ms = elapsed_ms(start);
+        start = std::chrono::steady_clock::now();
+        render_volume(framebuffer, width, height, fov, map, all, all_stats);
+        double all_ms = elapsed_ms(start);
+        std::cout << radius << "\t" << 100.*map.occupied()/map.index.size() << "%\t" << bake << "\t" << skip_ms << "\t"
+                  << double(skip_stats.samples)/(width*height) << "\t" << all_ms << "\t" << double(all_stats.samples)/(width*height) << std::endl;
+    }
+}
 
+int main(int argc, char **argv) {
+    const int   width    = 1024;
+    const int   height   = 768;
+    const float fov      = M_PI/3.;
+    bool sdf = false, bench = false;
+    int bricks = 32; // per axis, of BRICK^3 voxels each
+    MarchSettings settings;
+    for (int i=1; i<argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--sdf") sdf = true;
+        else if (arg == "--bench") bench = true;
+        else if (arg == "--no-skip") settings.skip_empty = false;
+        else if (arg == "--bricks" && i+1<argc) bricks = std::max(1, std::stoi(argv[++i]));
+        else {
+            std::cerr << "usage: " << argv[0] << " [--sdf | --bench] [--no-skip] [--bricks N]" << std::endl;
+            return 1;
+        }
+    }
+    if (bench) {
+        run_bench(bricks);
+        return 0;
+    }
+
+    std::vector<vec3> framebuffer(width*height);
+    if (sdf) {
+        render_sdf(framebuffer, width, height, fov);
+    } else {
+        BrickMap map;
+        auto start = std::chrono::steady_clock::now();
+        build_fireball(map, sphere_radius, bricks);
+        std::cout << "brick map: " << map.occupied() << "/" << map.index.size() << " bricks occupied, "
+                  << map.bytes()/(1024.*1024.) << " MB, baked in " << elapsed_ms(start) << "ms" << std::endl;
+        MarchStats stats;
+        start = std::chrono::steady_clock::now();
+        render_volume(framebuffer, width, height, fov, map, settings, stats);
+        std::cout << "frame: " << elapsed_ms(start) << "ms, " << double(stats.samples)/(width*height) << " samples/ray, "
+                  << double(stats.bricks)/(width*height) << " bricks/ray, " << stats.early_exits << " rays ended early" << std::endl;
+    }
+    save_ppm("./out.ppm", framebuffer, width, height);
     return 0;
-}
\ No newline at end of file
+}
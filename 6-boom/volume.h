@@ -0,0 +1,183 @@
+#ifndef __VOLUME_H__
+#define __VOLUME_H__
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include "geometry.h"
+
+// Sparse brick map of a density field and an emission/absorption ray marcher over it.
+//
+// The bounding box is cut into bricks of BRICK^3 voxels. Density is sampled once, at the voxel corners,
+// and only bricks where it is non-zero anywhere are stored, each with its own (BRICK+1)^3 corners so that
+// trilinear lookups never leave the brick. The brick grid doubles as the occupancy (macro-cell) grid:
+// rays walk it with a 3D DDA and only march inside occupied bricks, so the work per frame follows the
+// occupied volume rather than the box.
+
+const int BRICK = 8;
+
+struct BrickMap {
+    vec3 lo, hi;
+    int res = 0;                // bricks per axis
+    float voxel = 0;            // voxel edge length
+    std::vector<int32_t> index; // res^3 entries, offset of the brick in data or -1 when empty
+    std::vector<float> data;    // (BRICK+1)^3 corner densities per occupied brick
+
+    // density(p) is sampled at the corners of every brick that may_be_occupied(brick lo, brick hi) does not rule out,
+    // so the bake too costs in proportion to the occupied volume when the field can bound itself
+    template <typename Density, typename Bound> void build(const vec3 &bmin, const vec3 &bmax, const int bricks, Density density, Bound may_be_occupied) {
+        lo = bmin;
+        hi = bmax;
+        res = bricks;
+        voxel = (hi.x - lo.x) / (res*BRICK);
+        index.assign(res*res*res, -1);
+        data.clear();
+        const int n = BRICK + 1;
+#pragma omp parallel
+        {
+            std::vector<float> corners(n*n*n);
+#pragma omp for schedule(dynamic, 1)
+            for (int b = 0; b < res*res*res; b++) {
+                const int bx = b%res, by = b/res%res, bz = b/(res*res);
+                vec3 brick_lo = lo + vec3{float(bx), float(by), float(bz)}*(voxel*BRICK);
+                if (!may_be_occupied(brick_lo, brick_lo + vec3{1, 1, 1}*(voxel*BRICK))) continue;
+                float max = 0;
+                for (int k=0; k<n; k++) for (int j=0; j<n; j++) for (int i=0; i<n; i++) {
+                    vec3 p = lo + vec3{float(bx*BRICK + i), float(by*BRICK + j), float(bz*BRICK + k)}*voxel;
+                    corners[i + (j + k*n)*n] = density(p);
+                    max = std::max(max, corners[i + (j + k*n)*n]);
+                }
+                if (max <= 0) continue;
+#pragma omp critical
+                {
+                    index[b] = data.size();
+                    data.insert(data.end(), corners.begin(), corners.end());
+                }
+            }
+        }
+    }
+
+    size_t occupied() const { return data.size()/((BRICK+1)*(BRICK+1)*(BRICK+1)); }
+    size_t bytes() const { return data.size()*sizeof(float) + index.size()*sizeof(int32_t); }
+    int32_t brick(const int bx, const int by, const int bz) const { return index[bx + (by + bz*res)*res]; }
+
+    // density anywhere in the box, 0 in empty bricks
+    float lookup(const vec3 &p) const {
+        int b[3];
+        for (size_t a=0; a<3; a++)
+            b[a] = std::max(0, std::min(res-1, int((p[a] - lo[a])/(voxel*BRICK))));
+        int32_t offset = brick(b[0], b[1], b[2]);
+        return offset < 0 ? 0 : sample(offset, b[0], b[1], b[2], p);
+    }
+
+    // trilinear density at p, which must lie in the occupied brick at offset
+    float sample(const int32_t offset, const int bx, const int by, const int bz, const vec3 &p) const {
+        const int n = BRICK + 1;
+        vec3 g = (p - lo)*(1.f/voxel) - vec3{float(bx*BRICK), float(by*BRICK), float(bz*BRICK)};
+        g = vec3{std::max(0.f, std::min(BRICK - 1e-3f, g.x)), std::max(0.f, std::min(BRICK - 1e-3f, g.y)), std::max(0.f, std::min(BRICK - 1e-3f, g.z))};
+        const int i = int(g.x), j = int(g.y), k = int(g.z);
+        const float fx = g.x - i, fy = g.y - j, fz = g.z - k;
+        const float *c = &data[offset + i + (j + k*n)*n];
+        float c00 = c[0]*(1-fx)     + c[1]*fx;
+        float c10 = c[n]*(1-fx)     + c[n+1]*fx;
+        float c01 = c[n*n]*(1-fx)   + c[n*n+1]*fx;
+        float c11 = c[n*n+n]*(1-fx) + c[n*n+n+1]*fx;
+        return (c00*(1-fy) + c10*fy)*(1-fz) + (c01*(1-fy) + c11*fy)*fz;
+    }
+};
+
+struct MarchSettings {
+    float step = 0;             // along the ray, 0 for one voxel
+    float absorption = 15;      // extinction per unit length at density 1
+    float emission = 3;         // radiance scale of the fire ramp
+    float min_transmittance = .01; // rays stop once the volume behind can no longer show
+    bool skip_empty = true;     // false marches every step across the box, for comparison
+};
+
+struct MarchStats {
+    uint64_t samples = 0, bricks = 0, early_exits = 0;
+};
+
+// colour of hot gas by density: smoke at the rim, red, orange and yellow towards the core
+vec3 palette_fire(const float d) {
+    const vec3   yellow{1.7, 1.3, 1.0};
+    const vec3   orange{1.0, 0.6, 0.0};
+    const vec3      red{1.0, 0.0, 0.0};
+    const vec3 darkgray{0.2, 0.2, 0.2};
+    const vec3     gray{0.4, 0.4, 0.4};
+    float x = std::max(0.f, std::min(1.f, d));
+    if (x<.25f) return gray + (darkgray-gray)*(x*4.f);
+    if (x<.5f)  return darkgray + (red-darkgray)*(x*4.f-1.f);
+    if (x<.75f) return red + (orange-red)*(x*4.f-2.f);
+    return orange + (yellow-orange)*(x*4.f-3.f);
+}
+
+// front-to-back emission/absorption along the ray, composited over background
+vec3 march(const BrickMap &map, const vec3 &orig, const vec3 &dir, const vec3 &background, const MarchSettings &settings, MarchStats &stats) {
+    float t0 = 0, t1 = std::numeric_limits<float>::max();
+    for (size_t a=0; a<3; a++) { // clip the ray to the box
+        float inv = 1.f/dir[a];
+        float ta = (map.lo[a] - orig[a])*inv, tb = (map.hi[a] - orig[a])*inv;
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    if (t0 >= t1) return background;
+
+    const float dt = settings.step > 0 ? settings.step : map.voxel;
+    const float brick_size = map.voxel*BRICK;
+    vec3 L{0, 0, 0};
+    float T = 1;
+    auto accumulate = [&](const float d) { // false once the ray is opaque
+        stats.samples++;
+        if (d <= 0) return true;
+        float alpha = 1 - std::exp(-d*settings.absorption*dt);
+        L = L + palette_fire(d)*(settings.emission*T*alpha);
+        T *= 1 - alpha;
+        return T >= settings.min_transmittance;
+    };
+
+    // sample positions sit on one grid along the ray whatever the bricks, so skipping leaves no seams
+    if (!settings.skip_empty) {
+        for (float k = std::ceil(t0/dt); k*dt < t1; k++)
+            if (!accumulate(map.lookup(orig + dir*(k*dt)))) {
+                stats.early_exits++;
+                return L;
+            }
+        return L + background*T;
+    }
+
+    // 3D DDA over the bricks from the entry point, marching only the occupied ones
+    vec3 entry = orig + dir*t0;
+    int cell[3], step[3];
+    float t_next[3], t_delta[3];
+    for (size_t a=0; a<3; a++) {
+        cell[a] = std::max(0, std::min(map.res-1, int((entry[a] - map.lo[a])/brick_size)));
+        step[a] = dir[a] < 0 ? -1 : 1;
+        float boundary = map.lo[a] + (cell[a] + (step[a] > 0))*brick_size;
+        t_delta[a] = dir[a] != 0 ? brick_size/std::fabs(dir[a]) : std::numeric_limits<float>::max();
+        t_next[a]  = dir[a] != 0 ? (boundary - orig[a])/dir[a] : std::numeric_limits<float>::max();
+    }
+    float t = t0;
+    while (t < t1) {
+        size_t a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        float t_exit = std::min(t_next[a], t1);
+        int32_t offset = map.brick(cell[0], cell[1], cell[2]);
+        if (offset >= 0) {
+            stats.bricks++;
+            for (float k = std::ceil(t/dt); k*dt < t_exit; k++)
+                if (!accumulate(map.sample(offset, cell[0], cell[1], cell[2], orig + dir*(k*dt)))) {
+                    stats.early_exits++;
+                    return L;
+                }
+        }
+        t = t_exit;
+        cell[a] += step[a];
+        t_next[a] += t_delta[a];
+        if (cell[a] < 0 || cell[a] >= map.res) break;
+    }
+    return L + background*T;
+}
+
+#endif //__VOLUME_H__